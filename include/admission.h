@@ -0,0 +1,127 @@
+#ifndef CNFLOW_ADMISSION_H_
+#define CNFLOW_ADMISSION_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <stdexcept>
+
+#include "tsque.h"
+
+namespace cnflow {
+
+/* What to do with a new input when the in-flight budget is used up.
+ * ADMIT_BLOCK: wait until earlier inputs finish.
+ * ADMIT_REJECT: fail the new input.
+ * ADMIT_SHED_OLDEST: fail the oldest queued input and admit the new one.
+ */
+typedef enum AdmissionPolicy {
+    ADMIT_BLOCK,
+    ADMIT_REJECT,
+    ADMIT_SHED_OLDEST
+} AdmissionPolicy_t;
+
+/* Set on the future of a request that was rejected or shed. */
+class AdmissionError : public std::runtime_error {
+public:
+    explicit AdmissionError(const char *what): std::runtime_error(what) {}
+};
+
+/* Global budget for images and bytes in flight, from admission until postprocess. Without
+ * setBudget, DEFAULT_MAX_IMAGES and DEFAULT_MAX_BYTES still bound the host memory of a flow.
+ */
+class AdmissionControl {
+public:
+    static const int DEFAULT_MAX_IMAGES = 1024;
+    static const size_t DEFAULT_MAX_BYTES = static_cast<size_t>(1) << 30;
+
+    AdmissionControl() {}
+
+    void setBudget(int max_images, size_t max_bytes) {
+        std::lock_guard<std::mutex> lock(locker);
+        _max_images = max_images;
+        _max_bytes = max_bytes;
+    }
+
+    /* Take budget for one image. Blocking waits until it fits, otherwise return false at once.
+     * A single image larger than max_bytes is admitted when nothing else is in flight. After
+     * cancel() it returns false instead of waiting.
+     */
+    bool acquire(size_t bytes, bool blocking) {
+        locker.lock();
+        while (!fits(bytes)) {
+            if (!blocking || cancelled) {
+                locker.unlock();
+                return false;
+            }
+            locker.unlock();
+            USLEEP(100);
+            locker.lock();
+        }
+        ++_images;
+        _bytes += bytes;
+        if (_images > _peak_images) {
+            _peak_images = _images;
+        }
+        if (_bytes > _peak_bytes) {
+            _peak_bytes = _bytes;
+        }
+        locker.unlock();
+        ++admitted;
+        return true;
+    }
+
+    void cancel() { cancelled = true; }
+
+    void release(int images, size_t bytes) {
+        std::lock_guard<std::mutex> lock(locker);
+        _images -= images;
+        _bytes -= bytes;
+    }
+
+    int images() {
+        std::lock_guard<std::mutex> lock(locker);
+        return _images;
+    }
+
+    size_t bytes() {
+        std::lock_guard<std::mutex> lock(locker);
+        return _bytes;
+    }
+
+    int peakImages() {
+        std::lock_guard<std::mutex> lock(locker);
+        return _peak_images;
+    }
+
+    size_t peakBytes() {
+        std::lock_guard<std::mutex> lock(locker);
+        return _peak_bytes;
+    }
+
+    std::atomic<uint64_t> admitted{0};
+    std::atomic<uint64_t> rejected{0};
+    std::atomic<uint64_t> shed{0};
+
+private:
+    bool fits(size_t bytes) {
+        if (_images == 0) {
+            return true;
+        }
+        return _images < _max_images && _bytes + bytes <= _max_bytes;
+    }
+
+    int _max_images = DEFAULT_MAX_IMAGES;
+    size_t _max_bytes = DEFAULT_MAX_BYTES;
+    int _images = 0;
+    size_t _bytes = 0;
+    int _peak_images = 0;
+    size_t _peak_bytes = 0;
+    std::mutex locker;
+    std::atomic<bool> cancelled{false};
+};
+
+}  // namespace cnflow
+
+#endif  // CNFLOW_ADMISSION_H_
@@ -1,27 +1,208 @@
 #ifndef CNFLOW_CNFLOW_H_
 #define CNFLOW_CNFLOW_H_
 
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
 #include <memory>
+#include <mutex>
+#include <string>
 #include <thread>
 #include <vector>
 
 #include <opencv2/opencv.hpp>
 #include "tsque.h"
 #include "cnmodel.h"
+#include "admission.h"
+#include "threadpool.h"
+#include "cnsink.h"
+#include "shmring.h"
+#include "reorder.h"
+#include "perfstat.h"
+#include "metrics.h"
+#include "faceboxes_preprocess.h"
+#include "faceboxes_postprocess.h"
 
 namespace cnflow {
 
+/* One in-process request: completed by postprocess through the promise. */
+typedef struct FlowRequest {
+    uint64_t id;
+    uint64_t submit_time;
+    std::promise<Detections> promise;
+} FlowRequest;
+
+/* One video file or stream decoded by a video source thread, with its counters. */
+typedef struct VideoStream {
+    std::string uri;
+    int frame_stride = 1;
+    bool drop_on_backpressure = true;
+
+    uint64_t start_time = 0;
+    uint64_t end_time = 0;
+    std::atomic<bool> finished{false};
+    std::atomic<uint64_t> decoded{0};
+    std::atomic<uint64_t> skipped{0};
+    std::atomic<uint64_t> dropped{0};
+    std::atomic<uint64_t> detected{0};
+    std::atomic<uint64_t> latency_us{0};
+    std::atomic<uint64_t> max_latency_us{0};
+    // Set with a reorder window, frames are then reported in decode order.
+    std::shared_ptr<ReorderBuffer> reorder;
+} VideoStream;
+
+/* A co-located producer process: requests and responses go through two shared-memory rings. */
+typedef struct ShmSource {
+    std::string name;
+    shmring::ShmRing *requests = nullptr;
+    shmring::ShmRing *responses = nullptr;
+
+    std::atomic<uint64_t> received{0};
+    std::atomic<uint64_t> invalid{0};
+    std::atomic<uint64_t> answered{0};
+    std::atomic<uint64_t> dropped{0};
+    // Set with a reorder window, responses then go out in request order.
+    std::shared_ptr<ReorderBuffer> reorder;
+} ShmSource;
+
+/* Startup gate: opens once every expected model replica is loaded and warmed up. The stages
+ * wait on it instead of polling, so they start together on a warm device.
+ */
+class ReadyBarrier {
+public:
+    void expect(int replicas) {
+        std::lock_guard<std::mutex> lock(locker);
+        expected += replicas;
+    }
+
+    /* True for the replica that opened the barrier. */
+    bool arrive() {
+        std::lock_guard<std::mutex> lock(locker);
+        if (++arrived < expected) {
+            return false;
+        }
+        open_time = cnmodel::time();
+        open = true;
+        cond.notify_all();
+        return true;
+    }
+
+    /* False if the barrier was cancelled instead of opened. */
+    bool wait() {
+        std::unique_lock<std::mutex> lock(locker);
+        cond.wait(lock, [this]() { return open || cancelled; });
+        return open;
+    }
+
+    void cancel() {
+        std::lock_guard<std::mutex> lock(locker);
+        cancelled = true;
+        cond.notify_all();
+    }
+
+    bool isOpen() { return open; }
+    uint64_t openTime() { return open_time; }
+
+private:
+    std::mutex locker;
+    std::condition_variable cond;
+    int expected = 0;
+    int arrived = 0;
+    std::atomic<bool> open{false};
+    bool cancelled = false;
+    uint64_t open_time = 0;
+};
+
+struct TiledImage;
+
+/* One pipeline input. Exactly one of imagename (a path), encoded, encoded_view, image or yuv
+ * is the source; request is set for inputs coming from submit(), stream for frames of a video
+ * source, shm for slots of a shared-memory source.
+ */
+typedef struct FlowInput {
+    std::string imagename;
+    std::vector<uchar> encoded;
+    // Encoded bytes used in place (1 x n CV_8U), not copied into encoded.
+    cv::Mat encoded_view;
+    cv::Mat image;
+    // A decoder's YUV 4:2:0 frame, preprocessed without converting it to BGR first.
+    cv::Mat yuv;
+    YuvFormat_t yuv_format = YUV_NV12;
+    std::shared_ptr<FlowRequest> request;
+    std::shared_ptr<VideoStream> stream;
+    std::shared_ptr<ShmSource> shm;
+    uint64_t shm_tag = 0;
+    // Holds the ring slot that image, yuv or encoded_view point into, released with the input.
+    std::shared_ptr<shmring::SlotHeader> shm_slot;
+    // The buffer of the source when results are delivered in order, seq taken from it at ingest.
+    std::shared_ptr<ReorderBuffer> reorder;
+    uint64_t seq = 0;
+    uint64_t enqueue_time = 0;
+    size_t charged_bytes = 0;
+    // One tile of a large image: image is the whole image at tile_scale, the tile is cut at
+    // (tile_x, tile_y), or the image is letterboxed as a whole when tile_x < 0.
+    std::shared_ptr<TiledImage> tiled;
+    int tile_x = 0;
+    int tile_y = 0;
+
+    FlowInput() {}
+    explicit FlowInput(const std::string &imagename): imagename(imagename) {}
+} FlowInput;
+
+struct FaceBoxesVariant;
+
+/* What postprocess needs to know about one image of a batch: where it came from and how it was
+ * scaled. The pixels stay on the device, frame is only set with CnFlow::keep_frames.
+ */
+typedef struct ImageMeta {
+    std::string imagename;
+    float ratio = 1.f;
+    std::shared_ptr<FlowRequest> request;
+    std::shared_ptr<VideoStream> stream;
+    std::shared_ptr<ShmSource> shm;
+    uint64_t shm_tag = 0;
+    uint64_t enqueue_time = 0;
+    std::shared_ptr<ReorderBuffer> reorder;
+    uint64_t seq = 0;
+    // The decoded BGR frame, or the YUV frame when the conversion was fused into the resize.
+    cv::Mat frame;
+    std::shared_ptr<shmring::SlotHeader> frame_slot;
+    // Set for a tile: its image, and where the tile starts in the image (original pixels).
+    std::shared_ptr<TiledImage> tiled;
+    float offset_x = 0.f;
+    float offset_y = 0.f;
+} ImageMeta;
+
+/* A large image cut into tiles. Its tiles are batched like images, with tiles of other images,
+ * and finish in any batch and order; the last one delivers the merged detections with meta.
+ */
+typedef struct TiledImage {
+    ImageMeta meta;
+    size_t charged_bytes = 0;
+    float scale = 1.f;                  // of the image the tiles were cut from
+    int num_tiles = 0;
+
+    std::mutex locker;
+    int finished = 0;
+    Detections boxes;
+} TiledImage;
+
+/* One batch from preprocess to postprocess: the device buffers and the per-image metadata,
+ * no host pixels.
+ */
 typedef struct HostDeviceInputArray {
-    std::vector<cv::Mat> hosts;
     void **in_mlu_ptr;
     void **out_mlu_ptr;
 
-    std::vector<std::string> imagenames;
-    std::vector<float> ratios;
+    std::vector<ImageMeta> images;
+    size_t charged_bytes = 0;
+    std::shared_ptr<FaceBoxesVariant> variant;
 
     HostDeviceInputArray() {}
-    HostDeviceInputArray(std::vector<cv::Mat> hosts, void **in_mlu_ptr, void **out_mlu_ptr): 
-        hosts(hosts), in_mlu_ptr(in_mlu_ptr), out_mlu_ptr(out_mlu_ptr) {}
+    HostDeviceInputArray(void **in_mlu_ptr, void **out_mlu_ptr): 
+        in_mlu_ptr(in_mlu_ptr), out_mlu_ptr(out_mlu_ptr) {}
 } Host_DeviceInputArray;
 
 typedef struct HostDeviceInput {
@@ -37,17 +218,132 @@ typedef struct HostDeviceInput {
         host(host), in_mlu_ptr(in_mlu_ptr), out_mlu_ptr(out_mlu_ptr) {}
 } Host_DeviceInput;
 
+/* Work done by one stage, read by the metrics sampler. workers: threads or executor tasks of
+ * the stage, model replicas for inference.
+ */
+typedef struct StageStats {
+    std::atomic<int> workers{0};
+    std::atomic<uint64_t> images{0};
+    std::atomic<uint64_t> batches{0};
+    std::atomic<uint64_t> busy_us{0};
+} StageStats;
+
+/* One compiled FaceBoxes model (.cambricon), its input size, batch and per-variant stats. */
+typedef struct FaceBoxesVariant {
+    std::string model_path;
+    std::string func_name;
+    int dp = 1;
+    int height = 0;
+    int width = 0;
+    int batch_size = 0;                 // dp * n
+    int num_models = 1;
+
+    std::vector<Prior> priors;
+    NativeHeads native_heads;
+    // The replica owning the device buffers, set by its infer thread before the startup barrier opens.
+    cnmodel::CnModel *model = nullptr;
+    tsque::TsQueue<Host_DeviceInputArray> batchQueue;
+
+    std::atomic<uint64_t> batches{0};
+    std::atomic<uint64_t> images{0};
+    std::atomic<uint64_t> infer_us{0};
+    std::atomic<uint64_t> latency_us{0};
+    std::atomic<uint64_t> max_latency_us{0};
+} FaceBoxesVariant;
+
+/* The variants of one input size, ascending by batch, and the images routed to them. Preprocess
+ * serves the size with the oldest routed image. Routed inputs that do not fit the bounded
+ * routedQueue wait in pending, in order, and move on before anything else is routed.
+ */
+typedef struct FaceBoxesGroup {
+    int height = 0;
+    int width = 0;
+    std::vector<std::shared_ptr<FaceBoxesVariant>> variants;
+    tsque::TsQueue<FlowInput> routedQueue;
+    std::deque<FlowInput> pending;
+    std::mutex pendingLocker;
+    std::atomic<int> num_pending{0};
+    std::atomic<uint64_t> routed{0};
+} FaceBoxesGroup;
+
 class CnFlow {
   public:
     CnFlow();
+    /* Stops the stage threads, the sources and the executor and joins them; inputs still in
+     * flight are dropped and their futures report a broken promise.
+     */
     ~CnFlow();
 
     void showQueueSize();
 
+    /* Sample the depth and fullness of every pipeline queue, the device memory pool, admission
+     * and the throughput and busy fraction of every stage each sample_ms on a background thread,
+     * and serve them as Prometheus text on http://127.0.0.1:port/metrics (port 0: no server).
+     * The bottleneck is the stage whose input queue stays full while its output queue stays
+     * empty, "none" while every queue drains. Sampling starts when the startup barrier opens
+     * and stops with the flow.
+     */
+    void startMetrics(int port, int sample_ms=100);
+    std::string metricsText();
+    std::string bottleneck();
+
     void join();
     void detach();
 
     void putImageList(const std::vector<std::string> &imagePath, int epoch);
+    void runFeedImageList();
+
+    /* Bounded-memory mode: at most max_images / max_bytes admitted and not yet postprocessed,
+     * the policy decides what happens to submit() beyond that. putImageList always blocks.
+     * Without a call, 1024 images / 1 GiB and ADMIT_BLOCK.
+     */
+    void setInflightBudget(int max_images, size_t max_bytes, AdmissionPolicy_t policy);
+    void showAdmission();
+
+    /* Deliver the results of every source (image list, submit(), each video and shared-memory
+     * source) in the order of its inputs, holding back at most window results per source
+     * behind a slow batch. Sources beyond the window wait, video sources with
+     * drop_on_backpressure drop the frame. Call before adding sources; 0 turns ordering off.
+     */
+    void setReorderWindow(int window);
+    void showReorderStats();
+
+    void showStageCounters();
+    void resetStageCounters();
+
+    /* Tiles and tiled images so far, tiles per image and per second, and the batch fill of
+     * every variant.
+     */
+    void showTileStats();
+
+    /* Decode a video file or stream (anything cv::VideoCapture opens) on its own thread, keep
+     * every frame_stride-th frame. With drop_on_backpressure, a frame that does not fit the
+     * in-flight budget or imageInputQueue is dropped instead of stalling the decoder.
+     * Frames of all streams are batched together by preprocess.
+     */
+    std::shared_ptr<VideoStream> addVideoSource(const std::string &uri, int frame_stride=1, bool drop_on_backpressure=true);
+    void runVideoSource(std::shared_ptr<VideoStream> stream);
+    void showVideoStats();
+
+    /* Serve a producer process through shared memory: creates the request ring /<name>_req of
+     * num_slots slots of slot_bytes and the response ring /<name>_rsp. Frames (BGR or encoded)
+     * are preprocessed straight from their slot, which goes back to the producer afterwards;
+     * the detections come back with the tag of the request (see shmring.h).
+     */
+    std::shared_ptr<ShmSource> addShmSource(const std::string &name, int num_slots=64, size_t slot_bytes=8 << 20);
+    void runShmSource(std::shared_ptr<ShmSource> source);
+    void showShmStats();
+
+    /* Cap the device memory pool shared by all models on the device (default: until the card is full). */
+    void setDeviceMemoryLimit(size_t bytes);
+
+    /* Submit one encoded (jpg/png/...) or decoded BGR image, the future is ready after postprocess. */
+    std::future<Detections> submit(const std::vector<uchar> &encoded);
+    std::future<Detections> submit(const cv::Mat &image);
+    /* Submit one NV12 or I420 frame, (rows * 3 / 2) x cols CV_8UC1 with even rows and cols; the
+     * future fails with std::invalid_argument for any other mat.
+     */
+    std::future<Detections> submitYuv(const cv::Mat &yuv, YuvFormat_t format);
 
     void addReadImage(int parallelism);
     void runReadImage();
@@ -60,45 +356,188 @@ class CnFlow {
     void addFaceBoxesForBatch(int parallelism);
     void runFaceBoxesForBatch();
 
+    /* Run the CPU stages (preprocess, postprocess) as tasks on a work-stealing pool sized to the
+     * hardware instead of one thread per replica. Call before the add* functions, whose
+     * parallelism then is the number of concurrent tasks of the stage.
+     */
+    void useExecutor(int num_threads=0, bool pin_cores=false, int numa_node=-1);
+
     void addFaceBoxesPreprocessEx(int parallelism);
     void runFaceBoxesPreprocessEx();
+    bool stepFaceBoxesPreprocessEx(bool blocking);
+
+    /* Register a compiled model before the add*Infer calls. With several input sizes an image
+     * goes to the smallest size it fits (the largest if it fits none) so it is never upscaled
+     * into a bigger model; within a size the batch is the largest one the queued images fill,
+     * the smallest one at low load. Without variants addFaceBoxesInfer registers
+     * faceboxes_model_path.
+     */
+    std::shared_ptr<FaceBoxesVariant> addFaceBoxesVariant(const std::string &model_path, const std::string &func_name="fusion_0", int dp=1);
+    void showVariantStats();
 
     void addFaceBoxesInfer(int parallelism, int dp, int buffer_size);
     void addFaceBoxesInfer(int dp);
-    void runFaceBoxesInfer(int dp, bool need_buffer, int parallelism, int buffer_size=1);
+    void runFaceBoxesInfer(std::shared_ptr<FaceBoxesVariant> variant, bool need_buffer, int buffer_size=1);
+
+    /* Event-driven inference: num_drivers threads share the model replicas, each keeps all of
+     * its replicas in flight with invoke_async and polls them for completion.
+     */
+    void addFaceBoxesInferAsync(int dp, int num_drivers=1);
+    void runFaceBoxesInferAsync(std::shared_ptr<FaceBoxesVariant> variant, bool need_buffer, int num_replicas, int buffer_size);
     
     void addFaceBoxesPostProcess(int parallelism);
     void runFaceBoxesPostProcess();
+    bool stepFaceBoxesPostProcess(bool blocking);
 
     std::vector<std::thread *> threads;
+    std::mutex threadsLocker;
+    // Set by ~CnFlow, every stage loop ends once it sees it.
+    std::atomic<bool> stopping{false};
+    threadpool::ThreadPool *executor = nullptr;
 
-    std::vector<cnmodel::CnModel *> faceboxesModels;
+    std::vector<std::shared_ptr<FaceBoxesVariant>> faceboxesVariants;
+    // Ascending by input area.
+    std::vector<std::shared_ptr<FaceBoxesGroup>> faceboxesGroups;
 
-    tsque::TsQueue<std::string> imagePathQueue;
+    tsque::TsQueue<FlowInput> imageInputQueue;
     // tsque::TsQueue<cv::Mat> faceboxesRawImageQueue;
     tsque::TsQueue<Host_DeviceInput> faceboxesInputQueue;
-    tsque::TsQueue<Host_DeviceInputArray> faceBoxesBatchInputQueue;
     tsque::TsQueue<Host_DeviceInputArray> faceboxesOutputQueue;
-    tsque::TsQueue<Host_DeviceInput> faceboxesPostQueue;
 
-    tsque::TsQueue<uint64_t> timeQueue;
+    // Sample windows, the latest stat_window samples are kept.
     tsque::TsQueue<uint64_t> faceBoxesPreprocessTimeQueue;
     tsque::TsQueue<uint64_t> FaceBoxesInferTimeQueue;
     tsque::TsQueue<uint64_t> FaceBoxesPostProcessTimeQueue;
+    // Submit-to-completion latency (us) of requests from submit().
+    tsque::TsQueue<uint64_t> requestLatencyQueue;
+    int stat_window = 100000;
+
+    // If set, postprocess hands every result to it, the sink writes them on its own thread.
+    cnsink::ResultSink *sink = nullptr;
+    std::atomic<uint64_t> result_id{0};
+
+    std::vector<std::shared_ptr<VideoStream>> videoStreams;
+    std::mutex videoStreamsLocker;
+
+    std::vector<std::shared_ptr<ShmSource>> shmSources;
+    std::mutex shmSourcesLocker;
+
+    // Images (or tiles) routed to one input size and not yet batched. Preprocess routes no more
+    // inputs than the fullest size has room for, counting the tiles still pending.
+    int routed_capacity = 320;
+
+    int reorder_window = 0;
+    std::shared_ptr<ReorderBuffer> imageListReorder;
+    std::shared_ptr<ReorderBuffer> requestReorder;
+
+    AdmissionControl admission;
+    AdmissionPolicy_t admission_policy = ADMIT_BLOCK;
 
     int epoch = 1;
     std::vector<float> model_output;
     std::vector<std::string> imagePath;
     std::string faceboxes_model_path;
     std::string faceboxes_func_name = "fusion_0";
+    // The largest input size of the variants.
     int faceboxes_height = 0;
     int faceboxes_width = 0;
     uint64_t time_start;
     uint64_t one_thrid_time;
     uint64_t two_thrid_time;
     int num_input = 0;
+    std::atomic<int> num_finished{0};
     int device = 0;
     bool fake_input = false;
+
+    /* If true, postprocess copies the raw fp16 device outputs and decodes only the priors
+     * above conf_threshold, instead of converting every anchor to float NCHW.
+     */
+    bool native_output = false;
+    /* If true, YUV inputs are converted, resized and letterboxed in one pass by
+     * faceboxes_preprocess_yuv; false converts the whole frame to BGR first.
+     */
+    bool fuse_yuv = true;
+    /* If true, every batch keeps the original frames (ImageMeta::frame) until postprocess, a
+     * shared-memory frame keeps its slot that long. Off, host pixels are freed after the upload.
+     */
+    bool keep_frames = false;
+    /* If true, every preprocess, infer and postprocess step reads the hardware counters of its
+     * thread (perfstat.h); showStageCounters reports IPC and misses per image of each stage.
+     */
+    bool stage_counters = false;
+    /* If true, an image that is still larger than the model input at tile_scale is cut into
+     * model-sized tiles overlapping by tile_overlap pixels instead of being shrunk into one
+     * input, so small faces keep their resolution. Tiles of different images fill the same
+     * batches; postprocess maps the boxes back and runs NMS across the tiles of an image. With
+     * tile_global the image is also letterboxed as a whole, for faces larger than a tile.
+     * Checked when the preprocess is added: tile_overlap is below the smaller side of every
+     * input size.
+     */
+    bool tiling = false;
+    float tile_scale = 1.f;
+    int tile_overlap = 64;
+    bool tile_global = true;
+    std::atomic<uint64_t> tiled_images{0};
+    std::atomic<uint64_t> tiles{0};
+
+    /* Invocations every model replica runs on scratch buffers before the stages start, so the
+     * first batches do not pay for a cold device. Replicas load and warm up in parallel.
+     */
+    int warmup_invokes = 2;
+    ReadyBarrier startup;
+    uint64_t create_time = 0;
+    // When the first image came out of postprocess (us, 0 until then).
+    std::atomic<uint64_t> first_result_time{0};
+    perfstat::Stage routeCounters{"route"};
+    perfstat::Stage preprocessCounters{"preprocess"};
+    perfstat::Stage inferCounters{"infer"};
+    perfstat::Stage postprocessCounters{"postprocess"};
+
+    StageStats preprocessStats;
+    StageStats inferStats;
+    StageStats postprocessStats;
+    std::atomic<uint64_t> num_post_batches{0};
+    float conf_threshold = 0.5f;
+    float nms_threshold = 0.3f;
+    int keep_top_k = 750;
+
+  private:
+    std::future<Detections> submitInput(FlowInput &input);
+    cv::Mat loadImage(const FlowInput &input);
+    bool modelsReady();
+    void routeImage(FlowInput &input);
+    void queueRouted(FaceBoxesGroup &group, const FlowInput &input);
+    void flushRouted(FaceBoxesGroup &group);
+    bool tileImage(FlowInput &input, FaceBoxesGroup &group);
+    bool mergeTile(ImageMeta &meta, Detections &boxes);
+    std::shared_ptr<FaceBoxesVariant> pickVariant(const FaceBoxesGroup &group, int depth);
+    void startFaceBoxesInfer(std::shared_ptr<FaceBoxesVariant> variant, int parallelism, int buffer_size);
+    void initFaceBoxesModel(std::shared_ptr<FaceBoxesVariant> variant, cnmodel::CnModel *moder, bool need_buffer);
+    std::vector<std::vector<int>> fetchNativeLocations(cnmodel::CnModel *moder, FaceBoxesVariant *variant,
+                                                       const std::shared_ptr<std::shared_ptr<uint16_t>> &outputs,
+                                                       void **out_mlu, int num_images);
+    float *floatImage(cnmodel::CnModel *moder, const std::shared_ptr<std::shared_ptr<float>> &outputs, int k, int i);
+    const uint16_t *nativeImage(cnmodel::CnModel *moder, const std::shared_ptr<std::shared_ptr<uint16_t>> &outputs, int k, int i);
+    size_t inputBytes(const FlowInput &input);
+    void failInput(FlowInput &input, std::exception_ptr error);
+    void showReorder(const std::string &source, ReorderBuffer *reorder);
+    void startThread(const std::function<void()> &body);
+    void cancelWaits();
+    void runMetricsSampler(int sample_ms);
+
+    metrics::MetricsServer *metricsServer = nullptr;
+    std::mutex metricsLocker;
+    std::string metrics_text;
+    std::string bottleneck_stage = "none";
+    bool sampling = false;
+    std::thread *sampler = nullptr;
+    std::atomic<bool> sampler_stop{false};
+
+    // When the first image was tiled and the last tiled image finished (us).
+    std::atomic<uint64_t> tile_first_time{0};
+    std::atomic<uint64_t> tile_last_time{0};
+
+    std::atomic<uint64_t> request_id{0};
 };
 
 }  // namespace mlu
@@ -1,8 +1,12 @@
 #ifndef CNFLOW_CNMODEL_H_
 #define CNFLOW_CNMODEL_H_
 
+#include <atomic>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "glog/logging.h"
@@ -21,19 +25,51 @@ do { \
 
 uint64_t time();
 
-class CnMemManager {
+typedef struct DevicePoolStats {
+    size_t capacity_bytes;
+    size_t allocated_bytes;     // held by the pool, free or outstanding
+    size_t outstanding_bytes;   // handed out and not freed yet
+    size_t high_water_bytes;    // max of outstanding_bytes
+    uint64_t outstanding_blocks;
+    uint64_t allocs;
+    uint64_t waits;             // allocs that had to wait for a free
+    uint64_t wait_us;
+    uint64_t exhausted;         // allocs that found the pool at its capacity
+} DevicePoolStats;
+
+/* Device memory shared by every model and function on one device. Blocks are rounded up to a
+ * size class and recycled through per-class free lists. The pool grows on demand up to
+ * capacity bytes, then frees idle blocks of other classes, then waits. The blocks of one
+ * batch are taken all at once, so batches never wait while holding part of their memory.
+ */
+class DevicePool {
 public:
-    CnMemManager() {}
-    CnMemManager(size_t num_buffers, std::vector<size_t> size_in_bytes);
-    CnMemManager(size_t num_buffers, cnrtDataDescArray_t dataDescArray, int array_length, int dp);
-    ~CnMemManager();
+    static DevicePool *get(int device);
 
-    void **pop();
-    void push(void **ptrs);
+    void setCapacity(size_t bytes);
+    /* Fills ptrs with one block per entry of bytes, false if not blocking and the pool is exhausted,
+     * or when abort is set while waiting.
+     */
+    bool alloc(const std::vector<size_t> &bytes, void **ptrs, bool blocking=true,
+               const std::atomic<bool> *abort=nullptr);
+    void free(void *ptr);
+
+    DevicePoolStats stats();
+    void show();
+
+    static size_t sizeClass(size_t bytes);
 
 private:
-    tsque::TsQueue<void **> buffer;
-    int n_size;
+    explicit DevicePool(int device);
+    void *tryAlloc(size_t size_class, bool &exhausted, bool &out_of_memory);
+    void releaseIdle(size_t needed);
+
+    int device;
+    size_t capacity = SIZE_MAX;
+    std::map<size_t, std::vector<void *>> free_blocks;
+    std::unordered_map<void *, size_t> outstanding;
+    DevicePoolStats counters = DevicePoolStats();
+    std::mutex locker;
 };
 
 struct Shape {
@@ -73,17 +109,42 @@ public:
              cnrtDimOrder_t _output_order=CNRT_NCHW);
     void invoke_ex(void **_input_mlu_ptrS, void **_output_mlu_ptrS);
     std::shared_ptr<std::shared_ptr<float>> invoke(void **ptr);
-    void **deviceAllocInput();
-    void **deviceAllocOutput();
+    /* Wait for the device buffers of a batch, nullptr if abort is set meanwhile. */
+    void **deviceAllocInput(const std::atomic<bool> *abort=nullptr);
+    void **deviceAllocOutput(const std::atomic<bool> *abort=nullptr);
+    void **tryDeviceAllocInput();
+    void **tryDeviceAllocOutput();
     void copyin(void **mlu_ptr, void **cpu_ptr);
     std::shared_ptr<std::shared_ptr<float>> copyout(void **mlu_ptr);
+    /* copyout_native: raw device bytes, fp16 in the device layout (NHWC, C aligned to
+     * output_aligned_c), no layout or type conversion. With copy, only the outputs marked true
+     * are copied, the host buffers of the others are left for copyout_ranges to fill.
+     */
+    std::shared_ptr<std::shared_ptr<uint16_t>> copyout_native(void **mlu_ptr, const std::vector<bool> &copy=std::vector<bool>());
+    /* Copy the [first, second) halves of output k to the same place in host, spans a few
+     * rows apart are merged into one copy.
+     */
+    void copyout_ranges(void **mlu_ptr, int k, uint16_t *host, std::vector<std::pair<size_t, size_t>> ranges);
     void freeInput(void **input_mlu);
     void freeOutput(void **output_mlu);
     ~CnModel();
 
     void invoke_ex(void **_input_mlu_ptrS, void **_output_mlu_ptrS, float *ptv);
 
+    /* invoke_async: enqueue on the stream and return, poll done() for the completion.
+     * At most one invocation per model is in flight.
+     */
+    void invoke_async(void **_input_mlu_ptrS, void **_output_mlu_ptrS);
+    /* False while the invocation runs, true once it completed; a failed one aborts. */
+    bool done();
+    /* Device time (ms) of the last completed invoke_async. */
+    float elapsed();
+
     std::vector<Shape> input_shapes;
+    std::vector<Shape> output_shapes;
+    std::vector<int> output_aligned_c;
+    // Device to host bytes copyout, copyout_native and copyout_ranges really copied.
+    std::atomic<uint64_t> d2h_bytes{0};
 
 private:
     int buffer_size;
@@ -93,8 +154,12 @@ private:
     cnrtDim3_t dim = {1, 1, 1};
     cnrtFunctionType_t func_type = CNRT_FUNC_TYPE_BLOCK;
 
-    CnMemManager *input_buffer;
-    CnMemManager *output_buffer;
+    void **allocBlocks(const std::vector<size_t> &bytes, bool blocking, const std::atomic<bool> *abort=nullptr);
+    void freeBlocks(void **ptrs, int num);
+
+    DevicePool *pool;
+    std::vector<size_t> input_batch_bytes;
+    std::vector<size_t> output_batch_bytes;
 };
 
 }  // namespace cnmodel
@@ -0,0 +1,66 @@
+#ifndef CNFLOW_CNSERVER_H_
+#define CNFLOW_CNSERVER_H_
+
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "cnflow.h"
+
+namespace cnserver {
+
+/* Wire format, all integers little endian:
+ *   request:  uint32 nbytes, nbytes of encoded image
+ *   response: uint32 nboxes, nboxes * cnflow::FaceBox, or uint32 RESPONSE_REJECTED
+ * A connection may send any number of requests, they are answered in order.
+ */
+const uint32_t RESPONSE_REJECTED = 0xffffffff;
+
+bool readAll(int fd, void *buf, size_t nbytes);
+bool writeAll(int fd, const void *buf, size_t nbytes);
+
+/* Connect to a loopback CnServer, return the socket fd or -1. */
+int connectLoopback(int port);
+bool sendRequest(int fd, const std::vector<uchar> &encoded);
+/* rejected is set when admission control refused the request or the image did not decode. */
+bool recvResponse(int fd, cnflow::Detections &boxes, bool &rejected);
+
+class CnServer {
+public:
+    CnServer(cnflow::CnFlow *flow, int port);
+    ~CnServer();
+
+    void start();
+    /* Stop accepting, shut every open connection down and wait for its thread. A connection
+     * waiting for a result finishes that request first.
+     */
+    void stop();
+
+private:
+    typedef struct Connection {
+        int fd;
+        std::thread thread;
+        std::atomic<bool> done{false};
+    } Connection;
+
+    void runAccept();
+    void runConnection(Connection *connection);
+    /* Join and close the connections whose thread finished, all of them with all. */
+    void reapConnections(bool all);
+
+    cnflow::CnFlow *flow;
+    int port;
+    int listen_fd = -1;
+    std::atomic<bool> running{false};
+    std::thread *accept_thread = nullptr;
+    std::mutex connections_locker;
+    std::list<std::unique_ptr<Connection>> connections;
+};
+
+}  // namespace cnserver
+
+#endif  // CNFLOW_CNSERVER_H_
@@ -0,0 +1,124 @@
+#ifndef CNFLOW_CNSINK_H_
+#define CNFLOW_CNSINK_H_
+
+#include <atomic>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <zlib.h>
+
+#include "tsque.h"
+#include "faceboxes_postprocess.h"
+
+namespace cnsink {
+
+typedef struct SinkRecord {
+    uint64_t id;
+    std::string imagename;
+    cnflow::Detections boxes;
+} SinkRecord;
+
+/* A writer gets whole batches of records from the sink thread only, it needs no locking. */
+class ResultWriter {
+public:
+    virtual ~ResultWriter() {}
+    virtual void write(const std::vector<SinkRecord> &records) = 0;
+    /* False if the file could not be written, the records written since the last flush are lost. */
+    virtual bool flush() = 0;
+    virtual uint64_t bytes() = 0;
+};
+
+/* One JSON object per line: {"id":0,"image":"a.jpg","boxes":[[x1,y1,x2,y2,score],...]}.
+ * With compress the file is gzip.
+ */
+class JsonLinesWriter : public ResultWriter {
+public:
+    JsonLinesWriter(const std::string &path, bool compress=false);
+    ~JsonLinesWriter();
+
+    void write(const std::vector<SinkRecord> &records) override;
+    bool flush() override;
+    uint64_t bytes() override { return written; }
+
+private:
+    FILE *file = nullptr;
+    gzFile gzfile = nullptr;
+    std::string buffer;
+    uint64_t written = 0;
+};
+
+/* Compact binary records, written in blocks:
+ *   block:  uint32 raw_bytes, uint32 stored_bytes, uint32 compressed, stored_bytes of records
+ *   record: uint64 id, uint16 name_bytes, name, uint32 nboxes, nboxes * FaceBox
+ * path + ".idx" holds one IndexEntry per record in write order, so any image is found without
+ * a scan; with compress every block is deflated on its own.
+ */
+class BinaryWriter : public ResultWriter {
+public:
+    typedef struct IndexEntry {
+        uint64_t block_offset;    // file offset of the block header
+        uint32_t record_offset;   // offset of the record in the raw block
+        uint32_t record_bytes;
+    } IndexEntry;
+
+    BinaryWriter(const std::string &path, bool compress=false);
+    ~BinaryWriter();
+
+    void write(const std::vector<SinkRecord> &records) override;
+    bool flush() override;
+    uint64_t bytes() override { return offset; }
+
+    /* Read back the index-th record in the file (its position in write order, not its id),
+     * false if it does not exist or the files do not agree.
+     */
+    static bool read(const std::string &path, uint64_t index, SinkRecord &record);
+
+private:
+    FILE *file = nullptr;
+    FILE *index_file = nullptr;
+    bool compress;
+    uint64_t offset = 0;
+    uint64_t index_bytes = 0;
+    std::vector<uint8_t> raw;
+    std::vector<uint8_t> stored;
+    std::vector<IndexEntry> entries;
+};
+
+/* Asynchronous sink: put() only queues, a background thread batches the records into the
+ * writer and flushes it at least every flush_ms. At most capacity records are buffered,
+ * beyond that put() blocks, or drops the record with drop_when_full.
+ */
+class ResultSink {
+public:
+    ResultSink(ResultWriter *writer, int capacity=65536, int batch_records=1024,
+               int flush_ms=100, bool drop_when_full=false);
+    ~ResultSink();
+
+    void put(SinkRecord &&record);
+    /* Write everything queued, flush and stop the thread. */
+    void close();
+    void show();
+
+    std::atomic<uint64_t> queued{0};
+    std::atomic<uint64_t> written{0};    // records flushed to the file
+    std::atomic<uint64_t> dropped{0};
+    std::atomic<uint64_t> flushes{0};
+    std::atomic<uint64_t> failed{0};     // records lost to failed writes
+
+private:
+    void run();
+
+    ResultWriter *writer;
+    tsque::TsQueue<SinkRecord> records;
+    int batch_records;
+    int flush_ms;
+    bool drop_when_full;
+    std::atomic<bool> running{true};
+    std::thread *thread = nullptr;
+};
+
+}  // namespace cnsink
+
+#endif  // CNFLOW_CNSINK_H_
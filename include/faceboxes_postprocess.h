@@ -0,0 +1,321 @@
+#ifndef __FACEBOXES_POSTPROCESS_H_
+#define __FACEBOXES_POSTPROCESS_H_
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace cnflow {
+
+typedef struct FaceBox {
+    float x1;
+    float y1;
+    float x2;
+    float y2;
+    float score;
+} FaceBox;
+
+typedef std::vector<FaceBox> Detections;
+
+typedef struct Prior {
+    float cx;
+    float cy;
+    float w;
+    float h;
+} Prior;
+
+/* FaceBoxes anchors: steps 32/64/128, min sizes {32, 64, 128}/{256}/{512},
+ * with 4x densification for 32 and 2x for 64.
+ */
+inline std::vector<Prior> faceboxes_priors(int height, int width) {
+    const int steps[3] = {32, 64, 128};
+    const std::vector<std::vector<int>> min_sizes = {{32, 64, 128}, {256}, {512}};
+
+    std::vector<Prior> priors;
+    for (int k = 0; k < 3; ++k) {
+        int fh = static_cast<int>(std::ceil(static_cast<float>(height) / steps[k]));
+        int fw = static_cast<int>(std::ceil(static_cast<float>(width) / steps[k]));
+        for (int i = 0; i < fh; ++i) {
+            for (int j = 0; j < fw; ++j) {
+                for (int min_size : min_sizes[k]) {
+                    float s_kx = static_cast<float>(min_size) / width;
+                    float s_ky = static_cast<float>(min_size) / height;
+                    int dense = min_size == 32 ? 4 : (min_size == 64 ? 2 : 1);
+                    for (int dy = 0; dy < dense; ++dy) {
+                        for (int dx = 0; dx < dense; ++dx) {
+                            float ox = dense == 1 ? 0.5f : static_cast<float>(dx) / dense;
+                            float oy = dense == 1 ? 0.5f : static_cast<float>(dy) / dense;
+                            Prior prior;
+                            prior.cx = (j + ox) * steps[k] / width;
+                            prior.cy = (i + oy) * steps[k] / height;
+                            prior.w = s_kx;
+                            prior.h = s_ky;
+                            priors.push_back(prior);
+                        }
+                    }
+                }
+            }
+        }
+    }
+    return priors;
+}
+
+inline float iou(const FaceBox &a, const FaceBox &b) {
+    float ix1 = std::max(a.x1, b.x1);
+    float iy1 = std::max(a.y1, b.y1);
+    float ix2 = std::min(a.x2, b.x2);
+    float iy2 = std::min(a.y2, b.y2);
+    float iw = std::max(0.f, ix2 - ix1);
+    float ih = std::max(0.f, iy2 - iy1);
+    float inter = iw * ih;
+    float area_a = (a.x2 - a.x1) * (a.y2 - a.y1);
+    float area_b = (b.x2 - b.x1) * (b.y2 - b.y1);
+    float uni = area_a + area_b - inter;
+    return uni > 0.f ? inter / uni : 0.f;
+}
+
+inline Detections nms(Detections boxes, float threshold, int keep_top_k) {
+    std::sort(boxes.begin(), boxes.end(), [](const FaceBox &a, const FaceBox &b) {
+        return a.score > b.score;
+    });
+
+    Detections keep;
+    std::vector<bool> suppressed(boxes.size(), false);
+    for (size_t i = 0; i < boxes.size(); ++i) {
+        if (suppressed[i]) {
+            continue;
+        }
+        keep.push_back(boxes[i]);
+        if (keep_top_k > 0 && static_cast<int>(keep.size()) >= keep_top_k) {
+            break;
+        }
+        for (size_t j = i + 1; j < boxes.size(); ++j) {
+            if (!suppressed[j] && iou(boxes[i], boxes[j]) > threshold) {
+                suppressed[j] = true;
+            }
+        }
+    }
+    return keep;
+}
+
+inline FaceBox decode_box(const Prior &prior, const float *loc, float score,
+                          int height, int width, float ratio) {
+    const float variance0 = 0.1f;
+    const float variance1 = 0.2f;
+
+    float cx = prior.cx + loc[0] * variance0 * prior.w;
+    float cy = prior.cy + loc[1] * variance0 * prior.h;
+    float w = prior.w * std::exp(loc[2] * variance1);
+    float h = prior.h * std::exp(loc[3] * variance1);
+
+    /* The image was letterboxed to the top-left corner, so only the scale has to be undone. */
+    FaceBox box;
+    box.x1 = (cx - w / 2) * width / ratio;
+    box.y1 = (cy - h / 2) * height / ratio;
+    box.x2 = (cx + w / 2) * width / ratio;
+    box.y2 = (cy + h / 2) * height / ratio;
+    box.score = score;
+    return box;
+}
+
+/* location: [num_priors, 4] offsets, confidence: [num_priors, 2] softmax scores. */
+inline Detections faceboxes_postprocess(const float *location, const float *confidence,
+                                        const std::vector<Prior> &priors,
+                                        int height, int width, float ratio,
+                                        float conf_threshold, float nms_threshold,
+                                        int keep_top_k) {
+    Detections boxes;
+    for (size_t p = 0; p < priors.size(); ++p) {
+        float score = confidence[p * 2 + 1];
+        if (score < conf_threshold) {
+            continue;
+        }
+        boxes.push_back(decode_box(priors[p], location + p * 4, score, height, width, ratio));
+    }
+    return nms(std::move(boxes), nms_threshold, keep_top_k);
+}
+
+inline float half_to_float(uint16_t h) {
+    uint32_t sign = (h & 0x8000u) << 16;
+    uint32_t exp = (h >> 10) & 0x1f;
+    uint32_t mant = h & 0x3ff;
+    uint32_t bits;
+    if (exp == 0x1f) {
+        bits = sign | 0x7f800000u | (mant << 13);
+    }
+    else if (exp != 0) {
+        bits = sign | ((exp + 112) << 23) | (mant << 13);
+    }
+    else if (mant == 0) {
+        bits = sign;
+    }
+    else {
+        // Subnormal: normalize the mantissa.
+        exp = 113;
+        while ((mant & 0x400) == 0) {
+            mant <<= 1;
+            --exp;
+        }
+        bits = sign | (exp << 23) | ((mant & 0x3ff) << 13);
+    }
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+/* Largest fp16 <= value, for value >= 0. Non-negative fp16 values order like their bits. */
+inline uint16_t float_to_half_floor(float value) {
+    if (!(value > 0.f)) {
+        return 0;
+    }
+    if (value >= 65504.f) {
+        return 0x7bff;
+    }
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    int exp = static_cast<int>((bits >> 23) & 0xff) - 127;
+    uint32_t mant = bits & 0x7fffff;
+    if (exp < -24) {
+        return 0;
+    }
+    if (exp < -14) {
+        return static_cast<uint16_t>((mant | 0x800000) >> (-exp - 1));
+    }
+    return static_cast<uint16_t>(((exp + 15) << 10) | (mant >> 13));
+}
+
+/* Offsets of the host NCHW elements [0, count) of one image in the device layout:
+ * NHWC with C aligned to aligned_c.
+ */
+inline std::vector<uint32_t> native_offsets(int count, int c, int h, int w, int aligned_c) {
+    std::vector<uint32_t> offsets(count);
+    for (int k = 0; k < count; ++k) {
+        int ci = k / (h * w);
+        int hi = (k / w) % h;
+        int wi = k % w;
+        offsets[k] = (hi * w + wi) * aligned_c + ci;
+    }
+    return offsets;
+}
+
+/* Where the FaceBoxes heads live in one image of the raw device outputs. */
+typedef struct NativeHeads {
+    std::vector<uint32_t> fg_offsets;    // foreground score of every prior
+    std::vector<uint32_t> loc_offsets;   // 4 location offsets of every prior
+    uint32_t fg_base = 0;
+    uint32_t fg_stride = 0;              // 0 if fg_offsets is not an arithmetic sequence
+} NativeHeads;
+
+inline NativeHeads native_heads(int num_priors,
+                                int loc_c, int loc_h, int loc_w, int loc_aligned_c,
+                                int conf_c, int conf_h, int conf_w, int conf_aligned_c) {
+    NativeHeads heads;
+    std::vector<uint32_t> conf = native_offsets(num_priors * 2, conf_c, conf_h, conf_w, conf_aligned_c);
+    heads.loc_offsets = native_offsets(num_priors * 4, loc_c, loc_h, loc_w, loc_aligned_c);
+    for (int p = 0; p < num_priors; ++p) {
+        heads.fg_offsets.push_back(conf[p * 2 + 1]);
+    }
+
+    if (num_priors > 1) {
+        heads.fg_base = heads.fg_offsets[0];
+        heads.fg_stride = heads.fg_offsets[1] - heads.fg_offsets[0];
+        for (int p = 0; p < num_priors; ++p) {
+            if (heads.fg_offsets[p] != heads.fg_base + p * heads.fg_stride) {
+                heads.fg_stride = 0;
+                break;
+            }
+        }
+    }
+    return heads;
+}
+
+/* Priors whose fp16 foreground score bits are >= threshold. */
+inline void scan_foreground(const uint16_t *confidence, const NativeHeads &heads,
+                            uint16_t threshold, std::vector<int> &survivors) {
+    int num_priors = heads.fg_offsets.size();
+    int p = 0;
+#ifdef __SSE2__
+    // Score bits of positive halves compare as signed int16, negative halves come out negative.
+    if (heads.fg_stride == 1 || (heads.fg_stride == 2 && heads.fg_base >= 1)) {
+        const int stride = heads.fg_stride;
+        const int lanes = 8 / stride;
+        const int lane_mask = stride == 1 ? 0xffff : 0xcccc;
+        const uint16_t *base = confidence + heads.fg_base - (stride - 1);
+        const __m128i thr = _mm_set1_epi16(static_cast<short>(threshold - 1));
+        for (; p + lanes <= num_priors; p += lanes) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(base + p * stride));
+            int mask = _mm_movemask_epi8(_mm_cmpgt_epi16(v, thr)) & lane_mask;
+            while (mask) {
+                int bit = __builtin_ctz(mask);
+                survivors.push_back(p + bit / (2 * stride));
+                mask &= ~(3 << bit);
+            }
+        }
+    }
+#endif
+    if (heads.fg_stride > 0) {
+        const uint16_t *fg = confidence + heads.fg_base;
+        for (; p < num_priors; ++p) {
+            uint16_t score = fg[p * heads.fg_stride];
+            if (score >= threshold && score < 0x8000) {
+                survivors.push_back(p);
+            }
+        }
+    }
+    else {
+        for (; p < num_priors; ++p) {
+            uint16_t score = confidence[heads.fg_offsets[p]];
+            if (score >= threshold && score < 0x8000) {
+                survivors.push_back(p);
+            }
+        }
+    }
+}
+
+/* Decode the survivors of scan_foreground, only their location values are read. */
+inline Detections faceboxes_decode_native(const uint16_t *location, const uint16_t *confidence,
+                                          const NativeHeads &heads, const std::vector<int> &survivors,
+                                          const std::vector<Prior> &priors,
+                                          int height, int width, float ratio,
+                                          float conf_threshold, float nms_threshold,
+                                          int keep_top_k) {
+    Detections boxes;
+    for (int p : survivors) {
+        // The scan used the threshold rounded down to fp16, check again in float.
+        float score = half_to_float(confidence[heads.fg_offsets[p]]);
+        if (score < conf_threshold) {
+            continue;
+        }
+        float loc[4];
+        for (int k = 0; k < 4; ++k) {
+            loc[k] = half_to_float(location[heads.loc_offsets[p * 4 + k]]);
+        }
+        boxes.push_back(decode_box(priors[p], loc, score, height, width, ratio));
+    }
+    return nms(std::move(boxes), nms_threshold, keep_top_k);
+}
+
+/* Filter-first postprocess on raw fp16 device outputs of one image: scan the foreground
+ * scores, convert and decode only the priors above conf_threshold.
+ */
+inline Detections faceboxes_postprocess_native(const uint16_t *location, const uint16_t *confidence,
+                                               const NativeHeads &heads,
+                                               const std::vector<Prior> &priors,
+                                               int height, int width, float ratio,
+                                               float conf_threshold, float nms_threshold,
+                                               int keep_top_k) {
+    std::vector<int> survivors;
+    scan_foreground(confidence, heads, float_to_half_floor(conf_threshold), survivors);
+    return faceboxes_decode_native(location, confidence, heads, survivors, priors, height, width, ratio,
+                                   conf_threshold, nms_threshold, keep_top_k);
+}
+
+}  // namespace cnflow
+
+#endif  // __FACEBOXES_POSTPROCESS_H_
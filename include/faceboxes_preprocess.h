@@ -1,27 +1,47 @@
 #ifndef __FACEBOXES_PREPROCESS_H_
 #define __FACEBOXES_PREPROCESS_H_
 
+#include <algorithm>
+#include <cstdint>
 #include <string>
 #include <utility>
+#include <vector>
 
 #include <opencv2/opencv.hpp>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 template <typename T>
 void crop(T *data, int height, int width, 
           T *crop_data, int y1, int x1, int crop_height, int crop_width, 
           int nchannels) {
+    // The pixels of a crop row are contiguous in both images.
+    int row = crop_width * nchannels;
     for (int i = 0; i < crop_height; ++i) {
-        for (int j = 0; j < crop_width; ++j) {
-            for (int c = 0; c < nchannels; ++c) {
-                int crop_idx = i * crop_width * nchannels + j * nchannels + c;
-                int src_idx = (i + y1) * width * nchannels + (j + x1) * nchannels + c;
-                crop_data[crop_idx] = data[src_idx];
-            }
-        }
+        const T *src = data + ((i + y1) * width + x1) * nchannels;
+        std::copy(src, src + row, crop_data + i * row);
+    }
+}
+
+/* Origins of tiles of size tile covering [0, size), spread evenly with at least overlap pixels
+ * shared by neighbours; one tile at 0 when size <= tile.
+ */
+inline std::vector<int> tile_origins(int size, int tile, int overlap) {
+    if (size <= tile) {
+        return std::vector<int>(1, 0);
     }
+    int stride = std::max(1, tile - overlap);
+    int n = (size - tile + stride - 1) / stride + 1;
+    std::vector<int> origins(n);
+    for (int i = 0; i < n; ++i) {
+        origins[i] = static_cast<int>(static_cast<int64_t>(size - tile) * i / (n - 1));
+    }
+    return origins;
 }
 
-cv::Mat faceboxes_preprocess(cv::Mat &rawimg, int height, int width, float &ratio) {
+inline cv::Mat faceboxes_preprocess(cv::Mat &rawimg, int height, int width, float &ratio) {
     cv::Mat dstimg;
 
     int imgheight = rawimg.rows;
@@ -39,6 +59,223 @@ cv::Mat faceboxes_preprocess(cv::Mat &rawimg, int height, int width, float &rati
     return std::move(dstimg);
 }
 
+/* YUV 4:2:0 frames in the OpenCV layout: a (rows * 3 / 2) x cols CV_8UC1 Mat, the Y plane then
+ * the chroma at half resolution.
+ */
+typedef enum YuvFormat {
+    YUV_NV12,   // interleaved UV rows
+    YUV_I420    // U plane, then V plane
+} YuvFormat_t;
+
+/* BT.601 limited range, as cv::cvtColor converts YUV 4:2:0 to BGR. */
+inline void yuv_to_bgr_row(const uint8_t *ys, const uint8_t *us, const uint8_t *vs, int n, uint8_t *bgr) {
+    int i = 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i y_off = _mm_set1_epi16(16);
+    const __m128i c_off = _mm_set1_epi16(128);
+    const __m128i round = _mm_set1_epi32(128);
+    // (luma, chroma) coefficient pairs for _mm_madd_epi16.
+    const __m128i r_ce = _mm_set1_epi32((409 << 16) | 298);
+    const __m128i g_cd = _mm_set1_epi32((static_cast<uint16_t>(-100) << 16) | 298);
+    const __m128i g_e = _mm_set1_epi32(static_cast<uint16_t>(-208));
+    const __m128i b_cd = _mm_set1_epi32((516 << 16) | 298);
+    uint8_t b[16], g[16], r[16];
+    for (; i + 8 <= n; i += 8) {
+        __m128i c = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(ys + i)), zero), y_off);
+        __m128i d = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(us + i)), zero), c_off);
+        __m128i e = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(vs + i)), zero), c_off);
+        __m128i ce_lo = _mm_unpacklo_epi16(c, e), ce_hi = _mm_unpackhi_epi16(c, e);
+        __m128i cd_lo = _mm_unpacklo_epi16(c, d), cd_hi = _mm_unpackhi_epi16(c, d);
+        __m128i e_lo = _mm_unpacklo_epi16(e, zero), e_hi = _mm_unpackhi_epi16(e, zero);
+        auto pack = [&](__m128i lo, __m128i hi) {
+            lo = _mm_srai_epi32(_mm_add_epi32(lo, round), 8);
+            hi = _mm_srai_epi32(_mm_add_epi32(hi, round), 8);
+            __m128i v = _mm_packs_epi32(lo, hi);
+            return _mm_packus_epi16(v, v);
+        };
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(r), pack(_mm_madd_epi16(ce_lo, r_ce), _mm_madd_epi16(ce_hi, r_ce)));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(g),
+                         pack(_mm_add_epi32(_mm_madd_epi16(cd_lo, g_cd), _mm_madd_epi16(e_lo, g_e)),
+                              _mm_add_epi32(_mm_madd_epi16(cd_hi, g_cd), _mm_madd_epi16(e_hi, g_e))));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(b), pack(_mm_madd_epi16(cd_lo, b_cd), _mm_madd_epi16(cd_hi, b_cd)));
+        for (int k = 0; k < 8; ++k) {
+            bgr[(i + k) * 3] = b[k];
+            bgr[(i + k) * 3 + 1] = g[k];
+            bgr[(i + k) * 3 + 2] = r[k];
+        }
+    }
+#endif
+    auto clamp = [](int v) { return static_cast<uint8_t>(v < 0 ? 0 : (v > 255 ? 255 : v)); };
+    for (; i < n; ++i) {
+        int c = ys[i] - 16;
+        int d = us[i] - 128;
+        int e = vs[i] - 128;
+        bgr[i * 3] = clamp((298 * c + 516 * d + 128) >> 8);
+        bgr[i * 3 + 1] = clamp((298 * c - 100 * d - 208 * e + 128) >> 8);
+        bgr[i * 3 + 2] = clamp((298 * c + 409 * e + 128) >> 8);
+    }
+}
+
+/* Row a and row b mixed with weight w256 / 256 of b. Returns a itself when w256 is 0. */
+inline const uint8_t *blend_rows(const uint8_t *a, const uint8_t *b, int w256, int n, uint8_t *out) {
+    if (w256 == 0) {
+        return a;
+    }
+    int i = 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i wa = _mm_set1_epi16(256 - w256);
+    const __m128i wb = _mm_set1_epi16(w256);
+    const __m128i half = _mm_set1_epi16(128);
+    // a * (256 - w) + b * w + 128 <= 65408 fits the unsigned 16 bit lanes.
+    for (; i + 16 <= n; i += 16) {
+        __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i));
+        __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + i));
+        __m128i lo = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(va, zero), wa),
+                                                 _mm_mullo_epi16(_mm_unpacklo_epi8(vb, zero), wb)), half);
+        __m128i hi = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(va, zero), wa),
+                                                 _mm_mullo_epi16(_mm_unpackhi_epi8(vb, zero), wb)), half);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8)));
+    }
+#endif
+    for (; i < n; ++i) {
+        out[i] = (a[i] * (256 - w256) + b[i] * w256 + 128) >> 8;
+    }
+    return out;
+}
+
+/* Bilinear taps of sample position f in [0, size), clamped at the edges like cv::resize. */
+inline void linear_tap(double f, int size, int &i0, int &i1, int &w256) {
+    if (f <= 0 || size == 1) {
+        i0 = i1 = 0;
+        w256 = 0;
+    }
+    else if (f >= size - 1) {
+        i0 = i1 = size - 1;
+        w256 = 0;
+    }
+    else {
+        i0 = static_cast<int>(f);
+        i1 = i0 + 1;
+        w256 = static_cast<int>((f - i0) * 256 + 0.5);
+    }
+}
+
+/* faceboxes_preprocess for a YUV 4:2:0 frame in one pass: resize (bilinear, the source rows
+ * are mixed vertically first, then the columns are sampled), letterbox top-left, and convert
+ * only the output pixels to BGR. The full resolution BGR frame is never made, the Y plane and
+ * chroma are read once per output row instead of written and read back as 3 bytes per pixel.
+ */
+inline cv::Mat faceboxes_preprocess_yuv(const cv::Mat &yuv, YuvFormat_t format, int height, int width, float &ratio) {
+    if (format == YUV_I420 && !yuv.isContinuous()) {
+        return faceboxes_preprocess_yuv(yuv.clone(), format, height, width, ratio);
+    }
+    int imgheight = yuv.rows * 2 / 3;
+    int imgwidth = yuv.cols;
+    ratio = std::min((float)height / imgheight, (float)width / imgwidth);
+    int rszheight = std::min(height, static_cast<int>(round(imgheight * ratio)));
+    int rszwidth = std::min(width, static_cast<int>(round(imgwidth * ratio)));
+    cv::Mat dstimg = cv::Mat::zeros(height, width, CV_8UC3);
+
+    // Chroma planes: NV12 has UV pairs in rows of the frame stride, I420 two packed planes.
+    int ch = (imgheight + 1) / 2;
+    int cw = (imgwidth + 1) / 2;
+    const uint8_t *yplane = yuv.data;
+    size_t ystep = yuv.step;
+    const uint8_t *uplane = yuv.data + imgheight * ystep;
+    const uint8_t *vplane;
+    size_t cstep;
+    int cpix;
+    if (format == YUV_NV12) {
+        vplane = uplane + 1;
+        cstep = ystep;
+        cpix = 2;
+    }
+    else {
+        cstep = cw;
+        vplane = uplane + ch * cstep;
+        cpix = 1;
+    }
+
+    double sx = static_cast<double>(imgwidth) / rszwidth;
+    double sy = static_cast<double>(imgheight) / rszheight;
+    std::vector<int> yx0(rszwidth), yx1(rszwidth), yxw(rszwidth);
+    std::vector<int> cx0(rszwidth), cx1(rszwidth), cxw(rszwidth);
+    for (int x = 0; x < rszwidth; ++x) {
+        double f = (x + 0.5) * sx - 0.5;
+        linear_tap(f, imgwidth, yx0[x], yx1[x], yxw[x]);
+        // Chroma sample c sits between luma columns 2c and 2c + 1.
+        linear_tap((f - 0.5) / 2, cw, cx0[x], cx1[x], cxw[x]);
+        cx0[x] *= cpix;
+        cx1[x] *= cpix;
+    }
+
+    std::vector<uint8_t> yrow(imgwidth), urow(cw * cpix), vrow(cw);
+    std::vector<uint8_t> ys(rszwidth), us(rszwidth), vs(rszwidth);
+    for (int y = 0; y < rszheight; ++y) {
+        double f = (y + 0.5) * sy - 0.5;
+        int r0, r1, w;
+        linear_tap(f, imgheight, r0, r1, w);
+        const uint8_t *yline = blend_rows(yplane + r0 * ystep, yplane + r1 * ystep, w, imgwidth, yrow.data());
+
+        linear_tap((f - 0.5) / 2, ch, r0, r1, w);
+        const uint8_t *uline;
+        const uint8_t *vline;
+        if (format == YUV_NV12) {
+            uline = blend_rows(uplane + r0 * cstep, uplane + r1 * cstep, w, cw * 2, urow.data());
+            vline = uline + 1;
+        }
+        else {
+            uline = blend_rows(uplane + r0 * cstep, uplane + r1 * cstep, w, cw, urow.data());
+            vline = blend_rows(vplane + r0 * cstep, vplane + r1 * cstep, w, cw, vrow.data());
+        }
+
+        for (int x = 0; x < rszwidth; ++x) {
+            ys[x] = (yline[yx0[x]] * (256 - yxw[x]) + yline[yx1[x]] * yxw[x] + 128) >> 8;
+            us[x] = (uline[cx0[x]] * (256 - cxw[x]) + uline[cx1[x]] * cxw[x] + 128) >> 8;
+            vs[x] = (vline[cx0[x]] * (256 - cxw[x]) + vline[cx1[x]] * cxw[x] + 128) >> 8;
+        }
+        yuv_to_bgr_row(ys.data(), us.data(), vs.data(), rszwidth, dstimg.ptr<uint8_t>(y));
+    }
+    return dstimg;
+}
+
+/* BGR to YUV 4:2:0 (BT.601 limited range, chroma of each 2x2 block averaged), for producers and
+ * tests without a YUV source. rows and cols of bgr must be even.
+ */
+inline cv::Mat bgr_to_yuv420(const cv::Mat &bgr, YuvFormat_t format) {
+    int h = bgr.rows;
+    int w = bgr.cols;
+    cv::Mat yuv(h * 3 / 2, w, CV_8UC1);
+    uint8_t *yplane = yuv.data;
+    uint8_t *uplane = yuv.data + h * w;
+    uint8_t *vplane = format == YUV_NV12 ? uplane + 1 : uplane + (h / 2) * (w / 2);
+    int cpix = format == YUV_NV12 ? 2 : 1;
+    int cstep = format == YUV_NV12 ? w : w / 2;
+    for (int y = 0; y < h; ++y) {
+        const uint8_t *p = bgr.ptr<uint8_t>(y);
+        for (int x = 0; x < w; ++x) {
+            int b = p[x * 3], g = p[x * 3 + 1], r = p[x * 3 + 2];
+            yplane[y * w + x] = ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+        }
+    }
+    for (int y = 0; y < h / 2; ++y) {
+        const uint8_t *p0 = bgr.ptr<uint8_t>(2 * y);
+        const uint8_t *p1 = bgr.ptr<uint8_t>(2 * y + 1);
+        for (int x = 0; x < w / 2; ++x) {
+            int s[3];
+            for (int k = 0; k < 3; ++k) {
+                s[k] = (p0[6 * x + k] + p0[6 * x + 3 + k] + p1[6 * x + k] + p1[6 * x + 3 + k] + 2) / 4;
+            }
+            int b = s[0], g = s[1], r = s[2];
+            uplane[y * cstep + x * cpix] = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+            vplane[y * cstep + x * cpix] = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+        }
+    }
+    return yuv;
+}
+
 template <typename T1, typename T2>
 void cvtType(T1 dst, T2 src, int size) {
     for (int i = 0; i < size; ++i) {
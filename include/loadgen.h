@@ -0,0 +1,92 @@
+#ifndef CNFLOW_LOADGEN_H_
+#define CNFLOW_LOADGEN_H_
+
+#include <cstdint>
+#include <future>
+#include <string>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+#include "cnflow.h"
+
+namespace loadgen {
+
+typedef enum Arrival {
+    ARRIVAL_CONSTANT,
+    ARRIVAL_POISSON,
+    ARRIVAL_BURSTY,
+    ARRIVAL_TRACE
+} Arrival_t;
+
+/* "constant", "poisson", "bursty" or "trace", false if the name is unknown. */
+bool parseArrival(const std::string &name, Arrival_t &arrival);
+
+/* Arrival offsets (us from the start of the run) of num_requests requests at rate per second.
+ * Bursty: burst_size requests at once, the bursts themselves arrive as a Poisson process.
+ */
+std::vector<uint64_t> arrivals(Arrival_t arrival, double rate, int num_requests, uint64_t seed=1, int burst_size=16);
+
+/* A recorded trace: one arrival timestamp in seconds per line, returned as us after the first. */
+std::vector<uint64_t> loadTrace(const std::string &path);
+
+/* The trace stretched or compressed to rate per second, repeated up to num_requests arrivals. */
+std::vector<uint64_t> scaleTrace(const std::vector<uint64_t> &trace, double rate, int num_requests);
+
+/* Random BGR images, for runs without recorded inputs. */
+std::vector<cv::Mat> syntheticImages(int count, int height, int width, uint64_t seed=1);
+
+/* One point of the latency-throughput curve. Latency is taken from the scheduled arrival, not
+ * from the submit, so a generator that falls behind does not hide the queueing delay.
+ */
+typedef struct LoadPoint {
+    double offered_qps = 0;
+    double achieved_qps = 0;
+    uint64_t sent = 0;
+    uint64_t completed = 0;
+    uint64_t rejected = 0;
+    double send_lag_us = 0;
+    double latency_mean_us = 0;
+    uint64_t latency_p50_us = 0;
+    uint64_t latency_p90_us = 0;
+    uint64_t latency_p99_us = 0;
+    uint64_t latency_p999_us = 0;
+    uint64_t latency_max_us = 0;
+} LoadPoint;
+
+/* Open-loop load: requests are submitted on schedule whether or not earlier ones completed,
+ * a collector thread polls the futures for completion.
+ */
+class LoadGenerator {
+public:
+    /* Inputs are submitted round-robin, the decoded images if any, otherwise the encoded ones. */
+    LoadGenerator(cnflow::CnFlow *flow, const std::vector<std::vector<uchar>> &encoded,
+                  const std::vector<cv::Mat> &decoded);
+
+    /* Submit at the given arrival offsets and wait for every request. */
+    LoadPoint run(const std::vector<uint64_t> &schedule);
+
+    /* One run of duration_sec per rate, in ascending order. Stops after the first rate whose
+     * achieved throughput is below saturation * offered, past it latency only grows with the run.
+     * The flow admits with ADMIT_REJECT meanwhile, so the sender never waits for the flow.
+     */
+    std::vector<LoadPoint> sweep(Arrival_t arrival, std::vector<double> rates, double duration_sec,
+                                 const std::vector<uint64_t> &trace=std::vector<uint64_t>(),
+                                 double saturation=0.9);
+
+    int burst_size = 16;
+    uint64_t seed = 1;
+
+private:
+    std::future<cnflow::Detections> submit(uint64_t index);
+
+    cnflow::CnFlow *flow;
+    std::vector<std::vector<uchar>> encoded;
+    std::vector<cv::Mat> decoded;
+};
+
+/* The curve as a JSON array with one object per point. */
+std::string curveJson(const std::vector<LoadPoint> &points);
+
+}  // namespace loadgen
+
+#endif  // CNFLOW_LOADGEN_H_
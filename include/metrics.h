@@ -0,0 +1,39 @@
+#ifndef CNFLOW_METRICS_H_
+#define CNFLOW_METRICS_H_
+
+#include <atomic>
+#include <functional>
+#include <string>
+#include <thread>
+
+namespace metrics {
+
+/* Minimal HTTP/1.0 server on 127.0.0.1:port for Prometheus scrapes: GET /metrics answers
+ * the text of the provider, anything else 404. One connection at a time on the accept thread,
+ * scrapes are rare and the text is prepared by the caller.
+ */
+class MetricsServer {
+public:
+    MetricsServer(int port, const std::function<std::string()> &provider);
+    ~MetricsServer();
+
+    void start();
+    void stop();
+
+private:
+    void runAccept();
+    void serve(int fd);
+
+    int port;
+    std::function<std::string()> provider;
+    int listen_fd = -1;
+    std::atomic<bool> running{false};
+    std::thread *accept_thread = nullptr;
+};
+
+/* Fetch http://127.0.0.1:port<path>, the body or an empty string. For tests and tools. */
+std::string httpGet(int port, const std::string &path);
+
+}  // namespace metrics
+
+#endif  // CNFLOW_METRICS_H_
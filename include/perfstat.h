@@ -0,0 +1,66 @@
+#ifndef CNFLOW_PERFSTAT_H_
+#define CNFLOW_PERFSTAT_H_
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+namespace perfstat {
+
+typedef enum Counter {
+    COUNTER_CYCLES,
+    COUNTER_INSTRUCTIONS,
+    COUNTER_LLC_MISSES,
+    COUNTER_BRANCH_MISSES,
+    COUNTER_CONTEXT_SWITCHES,
+    NUM_COUNTERS
+} Counter_t;
+
+/* Hardware counters of one pipeline stage, summed over every thread that ran it. */
+class Stage {
+public:
+    explicit Stage(const std::string &name): name(name) { reset(); }
+
+    /* "<name>: calls, images, IPC, and per image cycles / instructions / LLC misses /
+     * branch misses / context switches", or a note that nothing was counted.
+     */
+    std::string report();
+    void reset();
+
+    std::string name;
+    std::atomic<uint64_t> counts[NUM_COUNTERS];
+    std::atomic<uint64_t> calls{0};
+    std::atomic<uint64_t> images{0};
+    std::atomic<uint64_t> time_us{0};
+};
+
+/* Counts the calling thread while it runs one step of a stage. The counters of a thread are
+ * opened on its first Scope (user space only, so perf_event_paranoid <= 2 is enough) and
+ * stay open for the life of the thread; if they can not be opened, scopes count nothing.
+ */
+class Scope {
+public:
+    /* stage may be nullptr: profiling is off and the scope costs nothing. */
+    explicit Scope(Stage *stage);
+    ~Scope();
+
+    /* Images the step handled, for the per-image figures. */
+    void addImages(uint64_t count) { images += count; }
+    /* The step found no work: do not count it. */
+    void cancel() { stage = nullptr; }
+    /* Count up to here, before the step blocks on a full queue. */
+    void stop();
+
+private:
+    Stage *stage;
+    uint64_t images = 0;
+    uint64_t start_time = 0;
+    uint64_t start[NUM_COUNTERS];
+};
+
+/* False once opening the counters failed, e.g. perf_event_paranoid > 2 or no PMU in a VM. */
+bool available();
+
+}  // namespace perfstat
+
+#endif  // CNFLOW_PERFSTAT_H_
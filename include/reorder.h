@@ -0,0 +1,149 @@
+#ifndef CNFLOW_REORDER_H_
+#define CNFLOW_REORDER_H_
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+
+#include "tsque.h"
+
+namespace cnflow {
+
+/* Releases the results of one source in the order its inputs arrived. The source takes a
+ * sequence number per input at ingest, postprocess hands every result over with put() in
+ * whatever order the batches finish, and the result is delivered once all earlier ones were.
+ * At most window inputs are between the oldest undelivered one and the newest, so one slow
+ * batch holds back a bounded number of results; the source waits (or drops) beyond that.
+ */
+class ReorderBuffer {
+public:
+    explicit ReorderBuffer(int window): _window(std::max(1, window)) {}
+
+    /* The sequence number of the next input. Blocking waits while it would be window or more
+     * ahead of the oldest undelivered result, otherwise return false at once. After cancel()
+     * it returns false instead of waiting.
+     */
+    bool reserve(uint64_t &seq, bool blocking) {
+        uint64_t t1 = 0;
+        locker.lock();
+        while (_next >= _delivered + _window) {
+            if (!blocking || cancelled) {
+                locker.unlock();
+                ++full;
+                return false;
+            }
+            if (t1 == 0) {
+                t1 = now();
+            }
+            locker.unlock();
+            USLEEP(20);
+            locker.lock();
+        }
+        seq = _next++;
+        locker.unlock();
+        if (t1 != 0) {
+            ++stalls;
+            stall_us += now() - t1;
+        }
+        return true;
+    }
+
+    /* The result of seq: deliver runs once every earlier result was delivered, on the thread
+     * that fills the last gap. An empty deliver only fills the gap (a failed or dropped input).
+     */
+    void put(uint64_t seq, std::function<void()> deliver) {
+        std::unique_lock<std::mutex> lock(locker);
+        Entry &entry = pending[seq];
+        entry.deliver = std::move(deliver);
+        entry.put_time = now();
+        entry.waits = seq != _delivered;
+        _peak_held = std::max(_peak_held, pending.size());
+        // One thread delivers at a time, the others leave their results to it.
+        if (draining) {
+            return;
+        }
+        draining = true;
+        while (!pending.empty() && pending.begin()->first == _delivered) {
+            Entry head = std::move(pending.begin()->second);
+            pending.erase(pending.begin());
+            lock.unlock();
+
+            uint64_t wait = now() - head.put_time;
+            if (head.deliver) {
+                head.deliver();
+            }
+            ++delivered;
+            if (head.waits) {
+                ++held;
+                held_us += wait;
+                uint64_t max_wait = max_held_us;
+                while (wait > max_wait && !max_held_us.compare_exchange_weak(max_wait, wait)) {}
+            }
+
+            lock.lock();
+            ++_delivered;
+        }
+        draining = false;
+    }
+
+    /* Wait until every result put so far is delivered. */
+    void drain() {
+        while (true) {
+            {
+                std::lock_guard<std::mutex> lock(locker);
+                if (pending.empty() && !draining) {
+                    return;
+                }
+            }
+            USLEEP(100);
+        }
+    }
+
+    int window() { return _window; }
+
+    void cancel() { cancelled = true; }
+
+    size_t peakHeld() {
+        std::lock_guard<std::mutex> lock(locker);
+        return _peak_held;
+    }
+
+    // Results delivered, and how many of them waited for an earlier one and for how long (us).
+    std::atomic<uint64_t> delivered{0};
+    std::atomic<uint64_t> held{0};
+    std::atomic<uint64_t> held_us{0};
+    std::atomic<uint64_t> max_held_us{0};
+    // Inputs the source had to hold back (stalls) or drop (full) because the window was used up.
+    std::atomic<uint64_t> stalls{0};
+    std::atomic<uint64_t> stall_us{0};
+    std::atomic<uint64_t> full{0};
+
+private:
+    typedef struct Entry {
+        std::function<void()> deliver;
+        uint64_t put_time = 0;
+        bool waits = false;         // an earlier result was missing when it was put
+    } Entry;
+
+    static uint64_t now() {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    std::mutex locker;
+    std::map<uint64_t, Entry> pending;
+    uint64_t _window;
+    uint64_t _next = 0;
+    uint64_t _delivered = 0;
+    size_t _peak_held = 0;
+    bool draining = false;
+    std::atomic<bool> cancelled{false};
+};
+
+}  // namespace cnflow
+
+#endif  // CNFLOW_REORDER_H_
@@ -0,0 +1,100 @@
+#ifndef CNFLOW_SHMRING_H_
+#define CNFLOW_SHMRING_H_
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+#include "faceboxes_postprocess.h"
+
+namespace shmring {
+
+typedef enum SlotFormat {
+    SLOT_ENCODED = 0,       // bytes of a jpg/png/...
+    SLOT_BGR = 1,           // rows x cols CV_8UC3, continuous
+    SLOT_DETECTIONS = 2,    // response: bytes / sizeof(cnflow::FaceBox) boxes
+    SLOT_REJECTED = 3,      // response: the request was invalid or refused
+    SLOT_NV12 = 4,          // rows x cols frame, (rows * 3 / 2) x cols bytes
+    SLOT_I420 = 5
+} SlotFormat_t;
+
+/* Header of one slot, its payload follows. sequence decides who owns the slot: for the slot of
+ * position pos it is pos while free, pos + 1 once published, and pos + num_slots once the
+ * consumer released it for the next lap.
+ */
+typedef struct SlotHeader {
+    std::atomic<uint64_t> sequence;
+    uint64_t position;
+    uint64_t tag;           // chosen by the producer, echoed in the response
+    uint32_t format;
+    uint32_t rows;
+    uint32_t cols;
+    uint32_t bytes;
+} SlotHeader;
+
+typedef struct RingHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t num_slots;
+    uint32_t slot_bytes;
+    alignas(64) std::atomic<uint64_t> head;
+    alignas(64) std::atomic<uint64_t> tail;
+} RingHeader;
+
+/* Bounded multi-producer multi-consumer ring of fixed size slots in POSIX shared memory.
+ * The slots are handed out in place: a producer fills the payload of a claimed slot and
+ * publishes it, the consumer reads it where it is and releases it when done.
+ */
+class ShmRing {
+public:
+    /* The service creates the ring (replacing a stale one of a crashed run), producers open it. */
+    static ShmRing *create(const std::string &name, uint32_t num_slots, uint32_t slot_bytes);
+    static ShmRing *open(const std::string &name);
+    ~ShmRing();
+
+    /* Producer side: the next free slot, nullptr if the ring is full and not blocking. */
+    SlotHeader *claim(bool blocking);
+    void publish(SlotHeader *slot);
+
+    /* Consumer side: the oldest published slot and its position, nullptr if there is none and
+     * not blocking. release takes the position acquire returned, not the one in the slot header:
+     * the producer writes that one and could point the release at a slot still in use.
+     */
+    SlotHeader *acquire(bool blocking, uint64_t &position);
+    void release(SlotHeader *slot, uint64_t position);
+
+    uint8_t *payload(SlotHeader *slot) { return reinterpret_cast<uint8_t *>(slot) + sizeof(SlotHeader); }
+    uint32_t numSlots() { return header->num_slots; }
+    uint32_t slotBytes() { return header->slot_bytes; }
+    const std::string &name() { return ring_name; }
+
+private:
+    ShmRing(const std::string &name, void *base, size_t bytes, bool owner);
+    SlotHeader *slot(uint64_t position);
+
+    std::string ring_name;
+    void *base;
+    size_t bytes;
+    bool owner;
+    RingHeader *header;
+    size_t stride;
+};
+
+/* Producer helpers, they copy into the slot. To skip the copy, decode into payload() of a
+ * claimed slot and publish it.
+ */
+bool putFrame(ShmRing *ring, uint64_t tag, const cv::Mat &bgr, bool blocking=true);
+bool putEncoded(ShmRing *ring, uint64_t tag, const std::vector<uchar> &encoded, bool blocking=true);
+/* format is SLOT_NV12 or SLOT_I420, yuv a continuous (rows * 3 / 2) x cols CV_8UC1 Mat. */
+bool putYuv(ShmRing *ring, uint64_t tag, const cv::Mat &yuv, SlotFormat_t format, bool blocking=true);
+/* rejected is set when the service refused the request. */
+bool getResponse(ShmRing *ring, uint64_t &tag, cnflow::Detections &boxes, bool &rejected, bool blocking=true);
+
+/* Service side: write one response, false if the response ring is full. */
+bool putResponse(ShmRing *ring, uint64_t tag, const cnflow::Detections &boxes, bool rejected=false);
+
+}  // namespace shmring
+
+#endif  // CNFLOW_SHMRING_H_
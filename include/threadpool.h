@@ -0,0 +1,72 @@
+#ifndef CNFLOW_THREADPOOL_H_
+#define CNFLOW_THREADPOOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace threadpool {
+
+/* Returns true if it did some work. A recurring task is run again and again until the pool stops. */
+typedef std::function<bool()> Task;
+
+/* Work-stealing pool: every worker owns a deque of recurring tasks and runs them round-robin,
+ * taking from the head and requeueing at the tail; it steals the head of the others when it
+ * runs dry. A stolen task goes back to the deque it was added to, and a worker finding every
+ * deque empty sleeps until a task is queued. Tasks must not block, return false instead.
+ */
+class ThreadPool {
+public:
+    /* num_threads <= 0: one per online cpu (of numa_node if set).
+     * pin_cores: bind worker i to the i-th allowed cpu.
+     * numa_node >= 0: only use the cpus of this node, so first-touch memory stays local.
+     */
+    explicit ThreadPool(int num_threads=0, bool pin_cores=false, int numa_node=-1,
+                        const std::function<void()> &init=nullptr);
+    ~ThreadPool();
+
+    void addRecurring(const Task &task);
+    void stop();
+
+    int size() { return static_cast<int>(workers.size()); }
+
+    std::atomic<uint64_t> executed{0};
+    std::atomic<uint64_t> stolen{0};
+
+private:
+    struct Entry {
+        Task task;
+        int home;
+    };
+
+    struct Worker {
+        std::deque<Entry> tasks;
+        std::mutex locker;
+        std::thread *thread = nullptr;
+    };
+
+    void run(int index, int cpu);
+    std::function<void()> init;
+    bool take(int index, Entry &entry);
+    void queue(Entry entry);
+
+    std::vector<Worker *> workers;
+    std::atomic<bool> running{true};
+    std::atomic<int> next{0};
+    // Tasks sitting in a deque, and workers waiting for one.
+    std::atomic<int> queued{0};
+    std::atomic<int> sleeping{0};
+    std::mutex idle_locker;
+    std::condition_variable idle_cond;
+};
+
+/* Cpus listed in /sys/devices/system/node/node<numa_node>/cpulist, or all online cpus. */
+std::vector<int> allowedCpus(int numa_node);
+
+}  // namespace threadpool
+
+#endif  // CNFLOW_THREADPOOL_H_
@@ -1,6 +1,7 @@
 #ifndef CNFLOW_TSQUE_H_
 #define CNFLOW_TSQUE_H_
 
+#include <atomic>
 #include <deque>
 #include <mutex>
 #include <thread>
@@ -33,10 +34,18 @@ public:
 
     void resize(int capacity);
     int size();
+    /* capacity: as set by resize(), 0x7fffffff when unbounded. */
+    int capacity();
     bool empty();
     bool full();
+    /* cancel: wake every blocked push and pop for good, they give up instead of waiting. */
+    void cancel();
 
     int push(const T &data, TsQueuePosition_t pos=TSQUE_TAIL);
+    /* try_push: push data if not full, otherwise return -1 without blocking. */
+    int try_push(const T &data, TsQueuePosition_t pos=TSQUE_TAIL);
+    /* push_evict: push data to tail, drop the head when full. For sample windows. */
+    void push_evict(const T &data);
     void push_n(const std::vector<T> &datas, TsQueuePosition_t pos=TSQUE_TAIL);
 
     T pop(TsQueuePosition_t pos=TSQUE_HEAD);
@@ -44,15 +53,22 @@ public:
     T pop_ex(bool &ret, TsQueuePosition_t pos=TSQUE_HEAD);
     std::vector<T> force_pop_n(int n, TsQueuePosition_t pos=TSQUE_HEAD);
     std::vector<T> pop_n(int n, TsQueuePosition_t pos=TSQUE_HEAD);
+    /* try_pop_n: like pop_n but never blocks, the list is empty when queue is empty. */
+    std::vector<T> try_pop_n(int n, TsQueuePosition_t pos=TSQUE_HEAD);
+    /* peek: call f with the head under the lock, false when the queue is empty. */
+    template <typename F>
+    bool peek(F f);
 
 private:
     int force_push(const T &data, TsQueuePosition_t pos);
     T force_pop(TsQueuePosition_t pos);
+    bool wait_pop(T &data, TsQueuePosition_t pos);
 
     std::deque<T> datas;
     int _capacity = 0x7fffffff;
     int _size = 0;
     std::mutex locker;
+    std::atomic<bool> cancelled{false};
 };
 
 template <typename T>
@@ -100,6 +116,11 @@ bool TsQueue<T>::full() {
     return _size >= _capacity;
 }
 
+template <typename T>
+void TsQueue<T>::cancel() {
+    cancelled = true;
+}
+
 
 template <typename T>
 int TsQueue<T>::force_push(const T &data, TsQueuePosition_t pos) {
@@ -121,13 +142,17 @@ int TsQueue<T>::force_push(const T &data, TsQueuePosition_t pos) {
 }
 
 /* Push data to deque. It will block if the size equal to capacity.
- * 
+ * Return -1 and drop data if the queue is cancelled while full.
  */
 template <typename T>
 int TsQueue<T>::push(const T &data, TsQueuePosition_t pos) {
     int ret = 0;
     locker.lock();
     while (_size >= _capacity) {
+        if (cancelled) {
+            locker.unlock();
+            return -1;
+        }
         locker.unlock();
         USLEEP(100);
         locker.lock();
@@ -138,6 +163,28 @@ int TsQueue<T>::push(const T &data, TsQueuePosition_t pos) {
     return ret;
 }
 
+template <typename T>
+int TsQueue<T>::try_push(const T &data, TsQueuePosition_t pos) {
+    locker.lock();
+    if (_size >= _capacity) {
+        locker.unlock();
+        return -1;
+    }
+    int ret = force_push(data, pos);
+    locker.unlock();
+    return ret;
+}
+
+template <typename T>
+void TsQueue<T>::push_evict(const T &data) {
+    locker.lock();
+    while (_size > 0 && _size >= _capacity) {
+        force_pop(TSQUE_HEAD);
+    }
+    force_push(data, TSQUE_TAIL);
+    locker.unlock();
+}
+
 template <typename T>
 T TsQueue<T>::force_pop(TsQueuePosition_t pos) {
     T data;
@@ -158,14 +205,15 @@ T TsQueue<T>::force_pop(TsQueuePosition_t pos) {
     return std::move(data);
 }
 
-/* Pop data from deque. It will block if the size is 0. 
- *
- */
+/* Wait for data, false if the queue is cancelled while empty. */
 template <typename T>
-T TsQueue<T>::pop(TsQueuePosition_t pos) {
-    T data;
+bool TsQueue<T>::wait_pop(T &data, TsQueuePosition_t pos) {
     locker.lock();
     while (_size <= 0) {
+        if (cancelled) {
+            locker.unlock();
+            return false;
+        }
         locker.unlock();
         USLEEP(100);
         locker.lock();
@@ -173,6 +221,16 @@ T TsQueue<T>::pop(TsQueuePosition_t pos) {
 
     data = force_pop(pos);
     locker.unlock();
+    return true;
+}
+
+/* Pop data from deque. It will block if the size is 0. 
+ * Return a default T if the queue is cancelled while empty.
+ */
+template <typename T>
+T TsQueue<T>::pop(TsQueuePosition_t pos) {
+    T data;
+    wait_pop(data, pos);
     return std::move(data);
 }
 
@@ -209,7 +267,11 @@ template <typename T>
 std::vector<T> TsQueue<T>::pop_n(int n, TsQueuePosition_t pos) {
     std::vector<T> list;
     bool ret;
-    list.emplace_back(pop(pos));
+    T first;
+    if (!wait_pop(first, pos)) {
+        return std::move(list);
+    }
+    list.emplace_back(std::move(first));
     for (int i = 1; i < n; ++i) {
         T data = pop_ex(ret, pos);
         if (ret == false) {
@@ -220,6 +282,17 @@ std::vector<T> TsQueue<T>::pop_n(int n, TsQueuePosition_t pos) {
     return std::move(list);
 }
 
+template <typename T> 
+std::vector<T> TsQueue<T>::try_pop_n(int n, TsQueuePosition_t pos) {
+    std::vector<T> list;
+    locker.lock();
+    while (_size > 0 && static_cast<int>(list.size()) < n) {
+        list.emplace_back(force_pop(pos));
+    }
+    locker.unlock();
+    return std::move(list);
+}
+
 template <typename T>
 void TsQueue<T>::push_n(const std::vector<T> &datas, TsQueuePosition_t pos) {
     for (auto data : datas) {
@@ -227,6 +300,26 @@ void TsQueue<T>::push_n(const std::vector<T> &datas, TsQueuePosition_t pos) {
     }
 }
 
+template <typename T>
+template <typename F>
+bool TsQueue<T>::peek(F f) {
+    std::lock_guard<std::mutex> lock(locker);
+    if (_size <= 0) {
+        return false;
+    }
+    f(datas.front());
+    return true;
+}
+
+template <typename T>
+int TsQueue<T>::capacity() {
+    int qcapacity;
+    locker.lock();
+    qcapacity = _capacity;
+    locker.unlock();
+    return qcapacity;
+}
+
 template <typename T>
 int TsQueue<T>::size() {
     int qsize;
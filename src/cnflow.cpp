@@ -1,10 +1,19 @@
+#include <algorithm>
+#include <map>
 #include <memory>
+#include <sstream>
+#include <stdexcept>
 
+#include <climits>
 #include <cmath>
+#include <cstring>
+
+#include <sys/resource.h>
 
 #include "cnflow.h"
 #include "cnmodel.h"
 #include "faceboxes_preprocess.h"
+#include "faceboxes_postprocess.h"
 
 #define MAX_CORE_NUM 16
 
@@ -16,6 +25,15 @@ void setdevice(int device) {
     CNRT_CHECK_V2(cnrtSetCurrentDevice(dev));
 }
 
+double queueMean(tsque::TsQueue<uint64_t> &queue) {
+    int size = queue.size();
+    double sum = 0;
+    for (int i = 0; i < size; ++i) {
+        sum += queue[i];
+    }
+    return size > 0 ? sum / size : 0.;
+}
+
 int get_core_num(int batch_size) {
 #define MLU270 (MAX_CORE_NUM == 16)
 #define MLU100 (MAX_CORE_NUM == 32)
@@ -36,21 +54,325 @@ int get_core_num(int batch_size) {
 }
 
 CnFlow::CnFlow() {
+    create_time = cnmodel::time();
     CNRT_CHECK_V2(cnrtInit(0));
 
-    faceBoxesBatchInputQueue.resize(320);
     faceboxesOutputQueue.resize(320);
+    faceBoxesPreprocessTimeQueue.resize(stat_window);
+    FaceBoxesInferTimeQueue.resize(stat_window);
+    FaceBoxesPostProcessTimeQueue.resize(stat_window);
+    requestLatencyQueue.resize(stat_window);
+}
+
+CnFlow::~CnFlow() {
+    stopping = true;
+    cancelWaits();
+    if (sampler != nullptr) {
+        sampler_stop = true;
+        sampler->join();
+        delete sampler;
+    }
+    delete metricsServer;
+    delete executor;
+    // A stage thread may still start the feed of the next epoch, take the list until it stays empty.
+    while (true) {
+        std::thread *thread;
+        {
+            std::lock_guard<std::mutex> lock(threadsLocker);
+            if (threads.empty()) {
+                break;
+            }
+            thread = threads.back();
+            threads.pop_back();
+        }
+        if (thread->joinable()) {
+            thread->join();
+        }
+        delete thread;
+    }
+}
+
+/* Wake every thread waiting in the flow, the waits give up and the loops see stopping. */
+void CnFlow::cancelWaits() {
+    startup.cancel();
+    admission.cancel();
+    imageInputQueue.cancel();
+    faceboxesOutputQueue.cancel();
+    for (auto &group : faceboxesGroups) {
+        group->routedQueue.cancel();
+    }
+    for (auto &variant : faceboxesVariants) {
+        variant->batchQueue.cancel();
+    }
+    for (auto reorder : {imageListReorder, requestReorder}) {
+        if (reorder) {
+            reorder->cancel();
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(videoStreamsLocker);
+        for (auto &stream : videoStreams) {
+            if (stream->reorder) {
+                stream->reorder->cancel();
+            }
+        }
+    }
+    std::lock_guard<std::mutex> lock(shmSourcesLocker);
+    for (auto &source : shmSources) {
+        if (source->reorder) {
+            source->reorder->cancel();
+        }
+    }
 }
 
-CnFlow::~CnFlow() {}
+void CnFlow::startThread(const std::function<void()> &body) {
+    std::lock_guard<std::mutex> lock(threadsLocker);
+    if (!stopping) {
+        threads.push_back(new std::thread(body));
+    }
+}
+
+void CnFlow::showQueueSize() {
+    std::ostringstream line;
+    line << "queues: input " << imageInputQueue.size();
+    if (faceboxesGroups.size() > 1 || tiling) {
+        for (auto &group : faceboxesGroups) {
+            line << " routed " << group->height << "x" << group->width << " " << group->routedQueue.size();
+        }
+    }
+    for (auto &variant : faceboxesVariants) {
+        line << " batch b" << variant->batch_size << " " << variant->batchQueue.size() << "/" << variant->batchQueue.capacity();
+    }
+    line << " output " << faceboxesOutputQueue.size() << "/" << faceboxesOutputQueue.capacity();
+    cnmodel::DevicePoolStats pool = cnmodel::DevicePool::get(device)->stats();
+    line << " device pool " << pool.outstanding_bytes << "/" << pool.allocated_bytes << " bytes";
+    if (sampling) {
+        line << " bottleneck " << bottleneck();
+    }
+    LOG(INFO) << line.str();
+}
+
+void CnFlow::startMetrics(int port, int sample_ms) {
+    sampling = true;
+    sampler = new std::thread(&CnFlow::runMetricsSampler, this, std::max(1, sample_ms));
+    if (port > 0) {
+        metricsServer = new metrics::MetricsServer(port, [this]() { return metricsText(); });
+        metricsServer->start();
+    }
+}
+
+std::string CnFlow::metricsText() {
+    std::lock_guard<std::mutex> lock(metricsLocker);
+    return metrics_text;
+}
+
+std::string CnFlow::bottleneck() {
+    std::lock_guard<std::mutex> lock(metricsLocker);
+    return bottleneck_stage;
+}
+
+static std::string labelValue(const std::string &value) {
+    std::string escaped;
+    for (char c : value) {
+        if (c == '\\' || c == '"') {
+            escaped += '\\';
+        }
+        escaped += c == '\n' ? ' ' : c;
+    }
+    return escaped;
+}
+
+/* Pressure of a queue is its fullness, smoothed over the last ~10 samples. An unbounded queue
+ * counts as full once it holds a batch for every preprocess worker. A stage scores
+ * pressure(input) * (1 - pressure(output)): it is the bottleneck when work piles up in front
+ * of it and the stage after it starves.
+ */
+void CnFlow::runMetricsSampler(int sample_ms) {
+    const double alpha = 0.1;
+    std::map<std::string, double> pressure;
+    StageStats *stages[] = {&preprocessStats, &inferStats, &postprocessStats};
+    const char *stage_names[] = {"preprocess", "infer", "postprocess"};
+    uint64_t last_images[3] = {0, 0, 0};
+    uint64_t last_busy[3] = {0, 0, 0};
+
+    // The variants and groups are registered before the startup barrier opens and never change
+    // after it, so only sample from then on.
+    while (!startup.isOpen() && !sampler_stop) {
+        USLEEP(sample_ms * 1000);
+    }
+    uint64_t last_time = cnmodel::time();
+
+    while (!sampler_stop) {
+        USLEEP(sample_ms * 1000);
+        uint64_t now = cnmodel::time();
+        double sec = std::max(1e-6, static_cast<double>(now - last_time) / 1000000.);
+        last_time = now;
+
+        int max_batch_size = 1;
+        for (auto &variant : faceboxesVariants) {
+            max_batch_size = std::max(max_batch_size, variant->batch_size);
+        }
+        double unbounded_full = static_cast<double>(max_batch_size) * std::max(1, static_cast<int>(preprocessStats.workers));
+
+        typedef struct QueueSample {
+            std::string labels;
+            std::string stage;      // the stage consuming the queue
+            int depth;
+            int capacity;
+        } QueueSample;
+        std::vector<QueueSample> queues;
+        queues.push_back({"queue=\"input\"", "preprocess", imageInputQueue.size(), imageInputQueue.capacity()});
+        if (faceboxesGroups.size() > 1 || tiling) {
+            for (auto &group : faceboxesGroups) {
+                queues.push_back({"queue=\"routed\",size=\"" + std::to_string(group->height) + "x" + std::to_string(group->width) + "\"",
+                                  "preprocess", group->routedQueue.size(), group->routedQueue.capacity()});
+            }
+        }
+        for (auto &variant : faceboxesVariants) {
+            queues.push_back({"queue=\"batch\",variant=\"" + labelValue(variant->model_path) + "\"",
+                              "infer", variant->batchQueue.size(), variant->batchQueue.capacity()});
+        }
+        queues.push_back({"queue=\"output\"", "postprocess", faceboxesOutputQueue.size(), faceboxesOutputQueue.capacity()});
+
+        // Input pressure of each stage: its fullest input queue.
+        std::map<std::string, double> stage_pressure;
+        std::ostringstream depth_lines, capacity_lines, pressure_lines;
+        for (auto &queue : queues) {
+            bool bounded = queue.capacity < INT_MAX;
+            double fullness = std::min(1., queue.depth / (bounded ? std::max(1, queue.capacity) : unbounded_full));
+            double &smoothed = pressure[queue.labels];
+            smoothed += alpha * (fullness - smoothed);
+            stage_pressure[queue.stage] = std::max(stage_pressure[queue.stage], smoothed);
+
+            depth_lines << "cnflow_queue_depth{" << queue.labels << "} " << queue.depth << "\n";
+            if (bounded) {
+                capacity_lines << "cnflow_queue_capacity{" << queue.labels << "} " << queue.capacity << "\n";
+            }
+            pressure_lines << "cnflow_queue_pressure{" << queue.labels << "} " << smoothed << "\n";
+        }
+
+        std::ostringstream text;
+        text << "# HELP cnflow_queue_depth Items in a pipeline queue.\n"
+             << "# TYPE cnflow_queue_depth gauge\n" << depth_lines.str()
+             << "# HELP cnflow_queue_capacity Capacity of a bounded pipeline queue.\n"
+             << "# TYPE cnflow_queue_capacity gauge\n" << capacity_lines.str()
+             << "# HELP cnflow_queue_pressure Fullness of a queue (0..1), smoothed over ~10 samples.\n"
+             << "# TYPE cnflow_queue_pressure gauge\n" << pressure_lines.str();
+
+        std::ostringstream total_lines, rate_lines, busy_lines, score_lines;
+        std::string worst = "none";
+        double worst_score = 0.5;
+        for (int i = 0; i < 3; ++i) {
+            uint64_t images = stages[i]->images;
+            uint64_t busy = stages[i]->busy_us;
+            int workers = std::max(1, static_cast<int>(stages[i]->workers));
+            double rate = (images - last_images[i]) / sec;
+            double busy_ratio = std::min(1., (busy - last_busy[i]) / (sec * 1000000. * workers));
+            last_images[i] = images;
+            last_busy[i] = busy;
+
+            double downstream = i + 1 < 3 ? stage_pressure[stage_names[i + 1]] : 0.;
+            double score = stage_pressure[stage_names[i]] * (1. - downstream);
+            if (score > worst_score) {
+                worst_score = score;
+                worst = stage_names[i];
+            }
+
+            std::string label = std::string("{stage=\"") + stage_names[i] + "\"} ";
+            total_lines << "cnflow_stage_images_total" << label << images << "\n";
+            rate_lines << "cnflow_stage_images_per_second" << label << rate << "\n";
+            busy_lines << "cnflow_stage_busy_ratio" << label << busy_ratio << "\n";
+            score_lines << "cnflow_stage_bottleneck_score" << label << score << "\n";
+        }
+        text << "# HELP cnflow_stage_images_total Images a stage has finished.\n"
+             << "# TYPE cnflow_stage_images_total counter\n" << total_lines.str()
+             << "# HELP cnflow_stage_images_per_second Throughput of a stage over the last sample.\n"
+             << "# TYPE cnflow_stage_images_per_second gauge\n" << rate_lines.str()
+             << "# HELP cnflow_stage_busy_ratio Fraction of the workers of a stage that were busy.\n"
+             << "# TYPE cnflow_stage_busy_ratio gauge\n" << busy_lines.str()
+             << "# HELP cnflow_stage_bottleneck_score Input pressure times (1 - output pressure).\n"
+             << "# TYPE cnflow_stage_bottleneck_score gauge\n" << score_lines.str();
+        text << "# HELP cnflow_bottleneck The stage limiting throughput, none while every queue drains.\n"
+             << "# TYPE cnflow_bottleneck gauge\n";
+        for (const char *stage : {"none", "preprocess", "infer", "postprocess"}) {
+            text << "cnflow_bottleneck{stage=\"" << stage << "\"} " << (worst == stage ? 1 : 0) << "\n";
+        }
+
+        cnmodel::DevicePoolStats pool = cnmodel::DevicePool::get(device)->stats();
+        text << "# HELP cnflow_device_pool_bytes Device memory pool of the flow's device.\n"
+             << "# TYPE cnflow_device_pool_bytes gauge\n"
+             << "cnflow_device_pool_bytes{kind=\"capacity\"} " << (pool.capacity_bytes == SIZE_MAX ? 0 : pool.capacity_bytes) << "\n"
+             << "cnflow_device_pool_bytes{kind=\"allocated\"} " << pool.allocated_bytes << "\n"
+             << "cnflow_device_pool_bytes{kind=\"outstanding\"} " << pool.outstanding_bytes << "\n"
+             << "cnflow_device_pool_bytes{kind=\"high_water\"} " << pool.high_water_bytes << "\n"
+             << "# TYPE cnflow_device_pool_allocs_total counter\n"
+             << "cnflow_device_pool_allocs_total " << pool.allocs << "\n"
+             << "# TYPE cnflow_device_pool_waits_total counter\n"
+             << "cnflow_device_pool_waits_total " << pool.waits << "\n"
+             << "# TYPE cnflow_device_pool_wait_us_total counter\n"
+             << "cnflow_device_pool_wait_us_total " << pool.wait_us << "\n"
+             << "# TYPE cnflow_device_pool_exhausted_total counter\n"
+             << "cnflow_device_pool_exhausted_total " << pool.exhausted << "\n";
+
+        text << "# HELP cnflow_startup_seconds Since the flow was created, until the models were ready and the first result.\n"
+             << "# TYPE cnflow_startup_seconds gauge\n";
+        if (startup.isOpen()) {
+            text << "cnflow_startup_seconds{phase=\"models_ready\"} " << (startup.openTime() - create_time) / 1e6 << "\n";
+        }
+        if (first_result_time > 0) {
+            text << "cnflow_startup_seconds{phase=\"first_result\"} " << (first_result_time - create_time) / 1e6 << "\n";
+        }
+
+        text << "# HELP cnflow_batch_fill Images (or tiles) per device batch over its batch size.\n"
+             << "# TYPE cnflow_batch_fill gauge\n";
+        for (auto &variant : faceboxesVariants) {
+            uint64_t batches = variant->batches;
+            text << "cnflow_batch_fill{variant=\"" << labelValue(variant->model_path) << "\"} "
+                 << (batches > 0 ? static_cast<double>(variant->images) / (batches * variant->batch_size) : 0.) << "\n";
+        }
+        if (tiling) {
+            text << "# TYPE cnflow_tiles_total counter\n"
+                 << "cnflow_tiles_total " << tiles << "\n"
+                 << "# TYPE cnflow_tiled_images_total counter\n"
+                 << "cnflow_tiled_images_total " << tiled_images << "\n";
+        }
+
+        text << "# HELP cnflow_inflight Admitted and not yet postprocessed.\n"
+             << "# TYPE cnflow_inflight gauge\n"
+             << "cnflow_inflight{kind=\"images\"} " << admission.images() << "\n"
+             << "cnflow_inflight{kind=\"bytes\"} " << admission.bytes() << "\n"
+             << "# TYPE cnflow_admission_total counter\n"
+             << "cnflow_admission_total{result=\"admitted\"} " << admission.admitted << "\n"
+             << "cnflow_admission_total{result=\"rejected\"} " << admission.rejected << "\n"
+             << "cnflow_admission_total{result=\"shed\"} " << admission.shed << "\n";
+
+        std::lock_guard<std::mutex> lock(metricsLocker);
+        metrics_text = text.str();
+        bottleneck_stage = worst;
+    }
+}
+
+void CnFlow::useExecutor(int num_threads, bool pin_cores, int numa_node) {
+    executor = new threadpool::ThreadPool(num_threads, pin_cores, numa_node, [this]() {
+        setdevice(device);
+    });
+}
 
 void CnFlow::join() {
-    for (auto thread : threads) {
-        thread->join();
+    std::vector<std::thread *> started;
+    {
+        std::lock_guard<std::mutex> lock(threadsLocker);
+        started = threads;
+    }
+    for (auto thread : started) {
+        if (thread->joinable()) {
+            thread->join();
+        }
     }
 }
 
 void CnFlow::detach() {
+    std::lock_guard<std::mutex> lock(threadsLocker);
     for (auto thread : threads) {
         thread->detach();
     }
@@ -60,120 +382,1089 @@ void CnFlow::putImageList(const std::vector<std::string> &imagePath, int epoch)
     this->epoch = epoch;
     this->imagePath = imagePath;
     num_input = imagePath.size();
-    for (auto path : imagePath) {
-        imagePathQueue.push(path);
+    num_finished = 0;
+    startThread(std::bind(&CnFlow::runFeedImageList, this));
+}
+
+/* Feed the image list through admission, so the list never sits in memory as queued inputs.
+ * The clock starts once the models are ready, loading and warmup are not part of the qps.
+ */
+void CnFlow::runFeedImageList() {
+    if (!startup.wait()) {
+        return;
     }
     time_start = cnmodel::time();
+    one_thrid_time = time_start;
+    two_thrid_time = time_start;
+    for (auto path : imagePath) {
+        FlowInput input(path);
+        input.enqueue_time = cnmodel::time();
+        input.charged_bytes = inputBytes(input);
+        // The blocking waits only give up when the flow stops.
+        if (!admission.acquire(input.charged_bytes, true)) {
+            return;
+        }
+        if (imageListReorder) {
+            input.reorder = imageListReorder;
+            if (!input.reorder->reserve(input.seq, true)) {
+                return;
+            }
+        }
+        if (imageInputQueue.push(input) != 0) {
+            return;
+        }
+    }
+}
+
+void CnFlow::setInflightBudget(int max_images, size_t max_bytes, AdmissionPolicy_t policy) {
+    admission.setBudget(max_images, max_bytes);
+    admission_policy = policy;
+    imageInputQueue.resize(max_images);
+}
+
+void CnFlow::setReorderWindow(int window) {
+    reorder_window = window;
+    imageListReorder.reset(window > 0 ? new ReorderBuffer(window) : nullptr);
+    requestReorder.reset(window > 0 ? new ReorderBuffer(window) : nullptr);
+}
+
+void CnFlow::showReorder(const std::string &source, ReorderBuffer *reorder) {
+    uint64_t held = reorder->held;
+    LOG(INFO) << "reorder " << source
+              << ": window " << reorder->window()
+              << " delivered " << reorder->delivered
+              << " held " << held
+              << " hol wait mean " << (held > 0 ? reorder->held_us / held : 0) << " us"
+              << " max " << reorder->max_held_us << " us"
+              << " peak buffered " << reorder->peakHeld()
+              << " source stalls " << reorder->stalls << " (" << reorder->stall_us << " us)"
+              << " dropped " << reorder->full;
+}
+
+/* Head-of-line blocking of every ordered source: how many results waited for an earlier one,
+ * how long, and how often the window held the source back.
+ */
+void CnFlow::showReorderStats() {
+    if (imageListReorder) {
+        showReorder("image list", imageListReorder.get());
+    }
+    if (requestReorder) {
+        showReorder("requests", requestReorder.get());
+    }
+    {
+        std::lock_guard<std::mutex> lock(videoStreamsLocker);
+        for (auto &stream : videoStreams) {
+            if (stream->reorder) {
+                showReorder(stream->uri, stream->reorder.get());
+            }
+        }
+    }
+    std::lock_guard<std::mutex> lock(shmSourcesLocker);
+    for (auto &source : shmSources) {
+        if (source->reorder) {
+            showReorder("shm " + source->name, source->reorder.get());
+        }
+    }
+}
+
+void CnFlow::showStageCounters() {
+    for (perfstat::Stage *stage : {&routeCounters, &preprocessCounters, &inferCounters, &postprocessCounters}) {
+        if (stage->calls > 0) {
+            LOG(INFO) << "counters " << stage->report();
+        }
+    }
+}
+
+void CnFlow::resetStageCounters() {
+    routeCounters.reset();
+    preprocessCounters.reset();
+    inferCounters.reset();
+    postprocessCounters.reset();
+}
+
+void CnFlow::showTileStats() {
+    uint64_t images = tiled_images;
+    uint64_t count = tiles;
+    double sec = static_cast<double>(tile_last_time - std::min<uint64_t>(tile_first_time, tile_last_time)) / 1000000.;
+    LOG(INFO) << "tiles: " << count << " of " << images << " images"
+              << ", " << (images > 0 ? static_cast<double>(count) / images : 0.) << " per image"
+              << ", " << (sec > 0 ? count / sec : 0.) << " tiles/s";
+    for (auto &variant : faceboxesVariants) {
+        uint64_t batches = variant->batches;
+        LOG(INFO) << "variant " << variant->model_path << " batch " << variant->batch_size
+                  << ": fill " << (batches > 0 ? static_cast<double>(variant->images) / (batches * variant->batch_size) : 0.);
+    }
+}
+
+void CnFlow::showAdmission() {
+    LOG(INFO) << "admission: admitted " << admission.admitted
+              << " rejected " << admission.rejected
+              << " shed " << admission.shed
+              << " peak images " << admission.peakImages()
+              << " peak bytes " << admission.peakBytes();
+}
+
+std::shared_ptr<VideoStream> CnFlow::addVideoSource(const std::string &uri, int frame_stride, bool drop_on_backpressure) {
+    std::shared_ptr<VideoStream> stream(new VideoStream);
+    stream->uri = uri;
+    stream->frame_stride = std::max(1, frame_stride);
+    stream->drop_on_backpressure = drop_on_backpressure;
+    if (reorder_window > 0) {
+        stream->reorder.reset(new ReorderBuffer(reorder_window));
+    }
+    {
+        std::lock_guard<std::mutex> lock(videoStreamsLocker);
+        videoStreams.push_back(stream);
+    }
+    startThread(std::bind(&CnFlow::runVideoSource, this, stream));
+    return stream;
+}
+
+void CnFlow::runVideoSource(std::shared_ptr<VideoStream> stream) {
+    cv::VideoCapture capture(stream->uri);
+    if (!capture.isOpened()) {
+        LOG(ERROR) << "Can not open video " << stream->uri;
+        stream->finished = true;
+        return;
+    }
+
+    stream->start_time = cnmodel::time();
+    for (uint64_t index = 0; !stopping; ++index) {
+        // Skipped frames are only grabbed, not decoded.
+        if (index % stream->frame_stride != 0) {
+            if (!capture.grab()) {
+                break;
+            }
+            ++stream->skipped;
+            continue;
+        }
+
+        FlowInput input;
+        if (!capture.read(input.image)) {
+            break;
+        }
+        ++stream->decoded;
+
+        input.imagename = stream->uri + ":" + std::to_string(index);
+        input.stream = stream;
+        input.enqueue_time = cnmodel::time();
+        input.charged_bytes = inputBytes(input);
+        if (!admission.acquire(input.charged_bytes, !stream->drop_on_backpressure)) {
+            ++stream->dropped;
+            continue;
+        }
+        if (stream->reorder) {
+            input.reorder = stream->reorder;
+            if (!input.reorder->reserve(input.seq, !stream->drop_on_backpressure)) {
+                admission.release(1, input.charged_bytes);
+                ++stream->dropped;
+                continue;
+            }
+        }
+        if (stream->drop_on_backpressure) {
+            if (imageInputQueue.try_push(input) != 0) {
+                admission.release(1, input.charged_bytes);
+                ++stream->dropped;
+                if (input.reorder) {
+                    input.reorder->put(input.seq, nullptr);
+                }
+            }
+        }
+        else {
+            imageInputQueue.push(input);
+        }
+    }
+    stream->end_time = cnmodel::time();
+    stream->finished = true;
+    LOG(INFO) << "video " << stream->uri << " finished";
+    showVideoStats();
+}
+
+void CnFlow::showVideoStats() {
+    std::lock_guard<std::mutex> lock(videoStreamsLocker);
+    for (auto &stream : videoStreams) {
+        uint64_t end = stream->finished ? stream->end_time : cnmodel::time();
+        double sec = static_cast<double>(end - stream->start_time) / 1000000.;
+        uint64_t detected = stream->detected;
+        LOG(INFO) << "video " << stream->uri
+                  << ": decode fps " << (sec > 0 ? stream->decoded / sec : 0.)
+                  << " decoded " << stream->decoded
+                  << " skipped " << stream->skipped
+                  << " dropped " << stream->dropped
+                  << " detected " << detected
+                  << " latency mean " << (detected > 0 ? stream->latency_us / detected : 0) << " us"
+                  << " max " << stream->max_latency_us << " us";
+    }
+}
+
+std::shared_ptr<ShmSource> CnFlow::addShmSource(const std::string &name, int num_slots, size_t slot_bytes) {
+    std::shared_ptr<ShmSource> source(new ShmSource);
+    source->name = name;
+    source->requests = shmring::ShmRing::create("/" + name + "_req", num_slots, slot_bytes);
+    source->responses = shmring::ShmRing::create("/" + name + "_rsp", num_slots, keep_top_k * sizeof(FaceBox));
+    CHECK(source->requests && source->responses) << "Can not create the rings of " << name;
+    if (reorder_window > 0) {
+        source->reorder.reset(new ReorderBuffer(reorder_window));
+    }
+    {
+        std::lock_guard<std::mutex> lock(shmSourcesLocker);
+        shmSources.push_back(source);
+    }
+    startThread(std::bind(&CnFlow::runShmSource, this, source));
+    return source;
+}
+
+/* Wrap every published slot as an input without copying it, the slot is released when
+ * preprocess drops the input. A full pipeline keeps the slots, which blocks the producer.
+ */
+void CnFlow::runShmSource(std::shared_ptr<ShmSource> source) {
+    shmring::ShmRing *ring = source->requests;
+    while (!stopping) {
+        // Poll instead of blocking in the ring, so the source stops with the flow.
+        uint64_t position;
+        shmring::SlotHeader *slot = ring->acquire(false, position);
+        if (slot == nullptr) {
+            USLEEP(20);
+            continue;
+        }
+        ++source->received;
+
+        FlowInput input;
+        input.shm_slot.reset(slot, [ring, position](shmring::SlotHeader *slot) { ring->release(slot, position); });
+        uint8_t *payload = ring->payload(slot);
+        // The header comes from the producer: nothing may reach past the slot.
+        bool fits = slot->bytes <= ring->slotBytes();
+        if (!fits) {
+            LOG(WARNING) << source->name << ": slot of " << slot->bytes << " bytes, the ring has " << ring->slotBytes();
+        }
+        if (fits && slot->format == shmring::SLOT_BGR && slot->rows > 0 && slot->cols > 0 &&
+            static_cast<size_t>(slot->rows) * slot->cols * 3 == slot->bytes) {
+            input.image = cv::Mat(slot->rows, slot->cols, CV_8UC3, payload);
+        }
+        else if (fits && (slot->format == shmring::SLOT_NV12 || slot->format == shmring::SLOT_I420) &&
+                 slot->rows > 0 && slot->cols > 0 && slot->rows % 2 == 0 && slot->cols % 2 == 0 &&
+                 static_cast<size_t>(slot->rows) * slot->cols * 3 / 2 == slot->bytes) {
+            input.yuv = cv::Mat(slot->rows * 3 / 2, slot->cols, CV_8UC1, payload);
+            input.yuv_format = slot->format == shmring::SLOT_NV12 ? YUV_NV12 : YUV_I420;
+        }
+        else if (fits && slot->format == shmring::SLOT_ENCODED && slot->bytes > 0) {
+            input.encoded_view = cv::Mat(1, slot->bytes, CV_8UC1, payload);
+        }
+        else {
+            ++source->invalid;
+            uint64_t tag = slot->tag;
+            input.shm_slot.reset();
+            auto reject = [source, tag]() {
+                if (!shmring::putResponse(source->responses, tag, Detections(), true)) {
+                    ++source->dropped;
+                }
+            };
+            uint64_t seq;
+            if (source->reorder && source->reorder->reserve(seq, true)) {
+                source->reorder->put(seq, reject);
+            }
+            else {
+                reject();
+            }
+            continue;
+        }
+
+        input.imagename = source->name + ":" + std::to_string(slot->tag);
+        input.shm = source;
+        input.shm_tag = slot->tag;
+        input.enqueue_time = cnmodel::time();
+        input.charged_bytes = inputBytes(input);
+        // The blocking waits only give up when the flow stops, the slot goes back with the input.
+        if (!admission.acquire(input.charged_bytes, true)) {
+            break;
+        }
+        if (source->reorder) {
+            input.reorder = source->reorder;
+            if (!input.reorder->reserve(input.seq, true)) {
+                break;
+            }
+        }
+        imageInputQueue.push(input);
+    }
+}
+
+void CnFlow::showShmStats() {
+    std::lock_guard<std::mutex> lock(shmSourcesLocker);
+    for (auto &source : shmSources) {
+        LOG(INFO) << "shm " << source->name
+                  << ": received " << source->received
+                  << " invalid " << source->invalid
+                  << " answered " << source->answered
+                  << " responses dropped " << source->dropped;
+    }
+}
+
+void CnFlow::setDeviceMemoryLimit(size_t bytes) {
+    cnmodel::DevicePool::get(device)->setCapacity(bytes);
+}
+
+size_t CnFlow::inputBytes(const FlowInput &input) {
+    size_t bytes = input.encoded.size() + input.encoded_view.total() + input.yuv.total() +
+                   input.image.total() * input.image.elemSize();
+    return bytes + static_cast<size_t>(faceboxes_height) * faceboxes_width * 3;
+}
+
+/* Give the budget of an input back and answer it with an error: the exception of its future,
+ * SLOT_REJECTED for a shared-memory request, in order when the source has a reorder buffer.
+ */
+void CnFlow::failInput(FlowInput &input, std::exception_ptr error) {
+    admission.release(1, input.charged_bytes);
+    if (input.request) {
+        input.request->promise.set_exception(error);
+    }
+    std::function<void()> answer;
+    if (input.shm) {
+        std::shared_ptr<ShmSource> source = input.shm;
+        uint64_t tag = input.shm_tag;
+        ++source->invalid;
+        answer = [source, tag]() {
+            if (!shmring::putResponse(source->responses, tag, Detections(), true)) {
+                ++source->dropped;
+            }
+        };
+    }
+    else if (input.stream) {
+        ++input.stream->dropped;
+    }
+    if (input.reorder) {
+        input.reorder->put(input.seq, answer);
+    }
+    else if (answer) {
+        answer();
+    }
+}
+
+std::future<Detections> CnFlow::submit(const std::vector<uchar> &encoded) {
+    FlowInput input;
+    input.encoded = encoded;
+    return submitInput(input);
+}
+
+std::future<Detections> CnFlow::submit(const cv::Mat &image) {
+    FlowInput input;
+    input.image = image;
+    return submitInput(input);
+}
+
+std::future<Detections> CnFlow::submitYuv(const cv::Mat &yuv, YuvFormat_t format) {
+    // The converters read cols x rows * 2 / 3 luma and two half-size chroma planes behind it.
+    if (yuv.empty() || yuv.type() != CV_8UC1 || !yuv.isContinuous() || yuv.rows % 3 != 0
+        || (yuv.rows * 2 / 3) % 2 != 0 || yuv.cols % 2 != 0) {
+        std::promise<Detections> promise;
+        promise.set_exception(std::make_exception_ptr(std::invalid_argument(
+            "yuv frame must be a continuous CV_8UC1 (rows * 3 / 2) x cols mat with even rows and cols")));
+        return promise.get_future();
+    }
+    FlowInput input;
+    input.yuv = yuv;
+    input.yuv_format = format;
+    return submitInput(input);
+}
+
+std::future<Detections> CnFlow::submitInput(FlowInput &input) {
+    std::shared_ptr<FlowRequest> request(new FlowRequest);
+    request->id = request_id++;
+    request->submit_time = cnmodel::time();
+    std::future<Detections> future = request->promise.get_future();
+
+    input.imagename = "request:" + std::to_string(request->id);
+    input.request = request;
+    input.enqueue_time = request->submit_time;
+    input.charged_bytes = inputBytes(input);
+
+    // Take the reorder slot first, shedding queued requests would be for nothing if this one
+    // can not get a sequence number anyway.
+    bool reserved = !requestReorder || requestReorder->reserve(input.seq, admission_policy == ADMIT_BLOCK);
+    if (reserved) {
+        input.reorder = requestReorder;
+    }
+    bool admitted = reserved && admission.acquire(input.charged_bytes, admission_policy == ADMIT_BLOCK);
+    while (!admitted && reserved && admission_policy == ADMIT_SHED_OLDEST) {
+        bool ret;
+        FlowInput oldest = imageInputQueue.pop_ex(ret);
+        if (!ret) {
+            break;
+        }
+        if (!oldest.request) {
+            // Image list inputs are never shed, the epoch would not finish.
+            imageInputQueue.push(oldest, tsque::TSQUE_HEAD);
+            break;
+        }
+        failInput(oldest, std::make_exception_ptr(AdmissionError("shed by admission control")));
+        ++admission.shed;
+        admitted = admission.acquire(input.charged_bytes, false);
+    }
+    if (!admitted) {
+        ++admission.rejected;
+        std::exception_ptr error = std::make_exception_ptr(AdmissionError("rejected by admission control"));
+        if (input.reorder) {
+            // The sequence number is taken, the rejection goes out in order like any result.
+            input.reorder->put(input.seq, [request, error]() { request->promise.set_exception(error); });
+        }
+        else {
+            request->promise.set_exception(error);
+        }
+        return future;
+    }
+
+    imageInputQueue.push(input);
+    return future;
+}
+
+cv::Mat CnFlow::loadImage(const FlowInput &input) {
+    if (!input.image.empty()) {
+        return input.image;
+    }
+    if (!input.encoded.empty()) {
+        return cv::imdecode(input.encoded, cv::IMREAD_COLOR);
+    }
+    if (!input.encoded_view.empty()) {
+        return cv::imdecode(input.encoded_view, cv::IMREAD_COLOR);
+    }
+    if (!input.yuv.empty()) {
+        cv::Mat bgr;
+        cv::cvtColor(input.yuv, bgr, input.yuv_format == YUV_NV12 ? cv::COLOR_YUV2BGR_NV12 : cv::COLOR_YUV2BGR_I420);
+        return bgr;
+    }
+    return cv::imread(input.imagename.c_str());
 }
 
 void CnFlow::addFaceBoxesPreprocessEx(int parallelism) {
+    if (tiling) {
+        CHECK(tile_scale > 0) << "tile_scale " << tile_scale << " must be positive";
+        for (auto &group : faceboxesGroups) {
+            CHECK(tile_overlap >= 0 && tile_overlap < std::min(group->height, group->width))
+                << "tile_overlap " << tile_overlap << " must be below the " << group->height << "x"
+                << group->width << " tiles";
+        }
+    }
+    preprocessStats.workers += parallelism;
     for (int i = 0; i < parallelism; ++i) {
-        threads.push_back(new std::thread(&CnFlow::runFaceBoxesPreprocessEx, this));
+        if (executor) {
+            executor->addRecurring([this]() { return stepFaceBoxesPreprocessEx(false); });
+        }
+        else {
+            startThread(std::bind(&CnFlow::runFaceBoxesPreprocessEx, this));
+        }
     }
 }
 
 void CnFlow::runFaceBoxesPreprocessEx() {
     setdevice(device);
-    do {
-        USLEEP(100);
-    } while (faceboxesModels.size() <= 0);
+    if (!startup.wait()) {
+        return;
+    }
 
-    while (true) {
-        // TODO: maybe not input_shapes[0]
-        auto images = imagePathQueue.pop_n(faceboxesModels[0]->dp * faceboxesModels[0]->input_shapes[0].n);
-        if (images.size() != faceboxesModels[0]->dp * faceboxesModels[0]->input_shapes[0].n) {
-            LOG(WARNING) << "expect " << faceboxesModels[0]->dp * faceboxesModels[0]->input_shapes[0].n << " pop " << images.size();
+    while (!stopping) {
+        stepFaceBoxesPreprocessEx(true);
+    }
+}
+
+bool CnFlow::modelsReady() {
+    return startup.isOpen();
+}
+
+/* Decode the input and queue it on the smallest input size holding it, the largest if none does. */
+void CnFlow::routeImage(FlowInput &input) {
+    // YUV frames keep their format for the fused preprocess, their size is known without decoding.
+    int rows = input.yuv.rows * 2 / 3;
+    int cols = input.yuv.cols;
+    if (input.yuv.empty() && (!fake_input || input.request)) {
+        input.image = loadImage(input);
+        input.encoded = std::vector<uchar>();
+        input.encoded_view = cv::Mat();
+        rows = input.image.rows;
+        cols = input.image.cols;
+    }
+
+    std::shared_ptr<FaceBoxesGroup> group = faceboxesGroups.back();
+    if (rows > 0) {
+        for (auto &candidate : faceboxesGroups) {
+            if (rows <= candidate->height && cols <= candidate->width) {
+                group = candidate;
+                break;
+            }
         }
+    }
+    if (tiling && rows > 0 && tileImage(input, *group)) {
+        return;
+    }
+    ++group->routed;
+    queueRouted(*group, input);
+}
 
-        uint64_t t1 = cnmodel::time();
+/* Route input to group without blocking: preprocess is the only consumer of the routed queues,
+ * a step waiting for room there would wait for itself.
+ */
+void CnFlow::queueRouted(FaceBoxesGroup &group, const FlowInput &input) {
+    {
+        std::lock_guard<std::mutex> lock(group.pendingLocker);
+        group.pending.push_back(input);
+        ++group.num_pending;
+    }
+    flushRouted(group);
+}
 
-        std::vector<float> ratios;
-        std::vector<cv::Mat> faceboxes_imgs;
-        for (int i = 0; i < images.size(); ++i) {
-            float ratio = 1.f;
-            if (fake_input) {
-                // Maybe not CV_8UC3
-                static std::vector<uint8_t> ones(faceboxes_height * faceboxes_width * 3, 1);
-                cv::Mat fake_img(faceboxes_height, faceboxes_width, CV_8UC3, ones.data());
-                faceboxes_imgs.emplace_back(fake_img);
+/* Move pending inputs of group to its routed queue while it has room, oldest first. */
+void CnFlow::flushRouted(FaceBoxesGroup &group) {
+    if (group.num_pending == 0) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(group.pendingLocker);
+    while (!group.pending.empty() && group.routedQueue.try_push(group.pending.front()) == 0) {
+        group.pending.pop_front();
+        --group.num_pending;
+    }
+}
+
+/* Cut an image still larger than the input of group at tile_scale into overlapping tiles of the
+ * input size, and route every tile as an input of its own. False if the image fits.
+ */
+bool CnFlow::tileImage(FlowInput &input, FaceBoxesGroup &group) {
+    int rows = input.yuv.empty() ? input.image.rows : input.yuv.rows * 2 / 3;
+    int cols = input.yuv.empty() ? input.image.cols : input.yuv.cols;
+    if (round(rows * tile_scale) <= group.height && round(cols * tile_scale) <= group.width) {
+        return false;
+    }
+    cv::Mat image = loadImage(input);
+    if (image.empty()) {
+        return false;
+    }
+    uint64_t no_tile = 0;
+    tile_first_time.compare_exchange_strong(no_tile, cnmodel::time());
+
+    cv::Mat scaled = image;
+    if (tile_scale != 1.f) {
+        cv::resize(image, scaled, cv::Size(), tile_scale, tile_scale);
+    }
+    // crop() reads continuous rows and every tile has to lie inside the image.
+    if (scaled.rows < group.height || scaled.cols < group.width) {
+        cv::copyMakeBorder(scaled, scaled, 0, std::max(0, group.height - scaled.rows),
+                           0, std::max(0, group.width - scaled.cols), cv::BORDER_CONSTANT, 0);
+    }
+    else if (!scaled.isContinuous()) {
+        scaled = scaled.clone();
+    }
+    std::vector<int> ys = tile_origins(scaled.rows, group.height, tile_overlap);
+    std::vector<int> xs = tile_origins(scaled.cols, group.width, tile_overlap);
+
+    std::shared_ptr<TiledImage> tiled(new TiledImage);
+    ImageMeta &meta = tiled->meta;
+    meta.imagename = input.imagename;
+    meta.request = std::move(input.request);
+    meta.stream = std::move(input.stream);
+    meta.shm = std::move(input.shm);
+    meta.shm_tag = input.shm_tag;
+    meta.enqueue_time = input.enqueue_time;
+    meta.reorder = std::move(input.reorder);
+    meta.seq = input.seq;
+    if (keep_frames) {
+        meta.frame = input.yuv.empty() ? image : input.yuv;
+        meta.frame_slot = input.shm_slot;
+    }
+    tiled->charged_bytes = input.charged_bytes;
+    tiled->scale = tile_scale;
+    tiled->num_tiles = ys.size() * xs.size() + (tile_global ? 1 : 0);
+
+    FlowInput tile;
+    tile.imagename = input.imagename;
+    tile.image = scaled;
+    tile.tiled = tiled;
+    tile.enqueue_time = input.enqueue_time;
+    // Unscaled, the tiles may still read from the slot of a shared-memory frame.
+    tile.shm_slot = input.shm_slot;
+    for (int y : ys) {
+        for (int x : xs) {
+            tile.tile_x = x;
+            tile.tile_y = y;
+            queueRouted(group, tile);
+        }
+    }
+    if (tile_global) {
+        tile.tile_x = -1;
+        tile.tile_y = 0;
+        queueRouted(group, tile);
+    }
+    group.routed += tiled->num_tiles;
+    tiles += tiled->num_tiles;
+    ++tiled_images;
+    return true;
+}
+
+/* Collect the boxes of one tile in the coordinates of its image. The tile finishing the image
+ * gets the boxes of all tiles after NMS across them and the metadata of the image, and returns true.
+ */
+bool CnFlow::mergeTile(ImageMeta &meta, Detections &boxes) {
+    std::shared_ptr<TiledImage> tiled = meta.tiled;
+    for (auto &box : boxes) {
+        box.x1 += meta.offset_x;
+        box.y1 += meta.offset_y;
+        box.x2 += meta.offset_x;
+        box.y2 += meta.offset_y;
+    }
+    {
+        std::lock_guard<std::mutex> lock(tiled->locker);
+        tiled->boxes.insert(tiled->boxes.end(), boxes.begin(), boxes.end());
+        if (++tiled->finished < tiled->num_tiles) {
+            return false;
+        }
+    }
+    boxes = nms(std::move(tiled->boxes), nms_threshold, keep_top_k);
+    meta = std::move(tiled->meta);
+    tile_last_time = cnmodel::time();
+    return true;
+}
+
+/* The largest batch the queued images fill, the smallest batch when they fill none. */
+std::shared_ptr<FaceBoxesVariant> CnFlow::pickVariant(const FaceBoxesGroup &group, int depth) {
+    std::shared_ptr<FaceBoxesVariant> picked = group.variants[0];
+    for (auto &variant : group.variants) {
+        if (variant->batch_size <= depth) {
+            picked = variant;
+        }
+    }
+    return picked;
+}
+
+/* Preprocess one batch. A non-blocking step reserves the device buffers and the room in
+ * the batch queue of the variant first, and returns false instead of waiting for them or for input.
+ * With several input sizes the step first decodes and routes a batch worth of inputs, then
+ * batches the size whose oldest routed image waited longest.
+ */
+bool CnFlow::stepFaceBoxesPreprocessEx(bool blocking) {
+    if (!modelsReady()) {
+        return false;
+    }
+
+    std::shared_ptr<FaceBoxesGroup> group = faceboxesGroups[0];
+    tsque::TsQueue<FlowInput> *source = &imageInputQueue;
+    bool wait_input = blocking;
+    bool routed = false;
+    if (faceboxesGroups.size() > 1 || tiling) {
+        int max_batch_size = 0;
+        int wanted = 0;
+        int room = INT_MAX;
+        bool idle = true;
+        for (auto &variant : faceboxesVariants) {
+            max_batch_size = std::max(max_batch_size, variant->batch_size);
+        }
+        for (auto &candidate : faceboxesGroups) {
+            // Tiles left over by an earlier step go first, they hold their room already.
+            flushRouted(*candidate);
+            int queued = candidate->routedQueue.size() + candidate->num_pending;
+            idle = idle && queued == 0;
+            wanted -= queued;
+            room = std::min(room, candidate->routedQueue.capacity() - queued);
+        }
+        // One large image may route many tiles, only decode more once the routed ones run low.
+        wanted = tiling ? std::max(0, wanted + max_batch_size) : max_batch_size;
+        // Every input may go to any size, take no more than the fullest routed queue holds.
+        wanted = std::min(wanted, room);
+        // Only wait for input when nothing is routed, routed images must not wait behind it.
+        std::vector<FlowInput> inputs;
+        if (wanted > 0) {
+            inputs = blocking && idle ? imageInputQueue.pop_n(wanted) : imageInputQueue.try_pop_n(wanted);
+        }
+        perfstat::Scope counted(stage_counters && !inputs.empty() ? &routeCounters : nullptr);
+        uint64_t t0 = cnmodel::time();
+        for (auto &input : inputs) {
+            routeImage(input);
+        }
+        counted.addImages(inputs.size());
+        if (!inputs.empty()) {
+            preprocessStats.busy_us += cnmodel::time() - t0;
+        }
+        routed = !inputs.empty();
+
+        // Serve the size whose oldest routed image waited longest, so load on one size never
+        // starves the others.
+        uint64_t oldest = UINT64_MAX;
+        for (auto &candidate : faceboxesGroups) {
+            uint64_t head = 0;
+            if (candidate->routedQueue.peek([&head](const FlowInput &input) { head = input.enqueue_time; }) && head < oldest) {
+                oldest = head;
+                group = candidate;
             }
-            else {
-                cv::Mat rawimg = cv::imread(images[i].c_str());
-                cv::Mat rszd_img = faceboxes_preprocess(rawimg, faceboxes_height, faceboxes_width, ratio);
-                faceboxes_imgs.emplace_back(rszd_img);
+        }
+        source = &group->routedQueue;
+        wait_input = false;
+    }
+
+    std::shared_ptr<FaceBoxesVariant> variant;
+    void **in_mlu = nullptr;
+    void **out_mlu = nullptr;
+    std::vector<FlowInput> inputs;
+    if (blocking) {
+        bool ret = true;
+        FlowInput first = wait_input ? source->pop() : source->pop_ex(ret);
+        if (!ret || stopping) {
+            return routed;
+        }
+        variant = pickVariant(*group, 1 + source->size());
+        inputs = source->try_pop_n(variant->batch_size - 1);
+        inputs.insert(inputs.begin(), std::move(first));
+    }
+    else {
+        int depth = source->size();
+        if (depth <= 0) {
+            return routed;
+        }
+        variant = pickVariant(*group, depth);
+        if (variant->batchQueue.full()) {
+            return routed;
+        }
+        in_mlu = variant->model->tryDeviceAllocInput();
+        out_mlu = in_mlu ? variant->model->tryDeviceAllocOutput() : nullptr;
+        if (out_mlu) {
+            inputs = source->try_pop_n(variant->batch_size);
+        }
+        if (inputs.empty()) {
+            if (in_mlu) {
+                variant->model->freeInput(in_mlu);
+            }
+            if (out_mlu) {
+                variant->model->freeOutput(out_mlu);
             }
-            ratios.push_back(ratio);
+            return routed;
         }
+    }
+    int batch_size = variant->batch_size;
 
-        std::shared_ptr<uint8_t> imgsptr = copyto<uint8_t>(faceboxes_imgs, faceboxesModels[0]->dp * faceboxesModels[0]->input_shapes[0].n);
-        uint8_t *p_imgsptr = imgsptr.get();
+    perfstat::Scope counted(stage_counters ? &preprocessCounters : nullptr);
+    counted.addImages(inputs.size());
+    uint64_t t1 = cnmodel::time();
 
-        void **in_mlu = faceboxesModels[0]->deviceAllocInput();
-        void **out_mlu = faceboxesModels[0]->deviceAllocOutput();
-        faceboxesModels[0]->copyin(in_mlu, (void **)&p_imgsptr);
+    std::vector<cv::Mat> faceboxes_imgs;
+    std::vector<ImageMeta> images;
+    images.reserve(inputs.size());
+    size_t charged_bytes = 0;
+    for (int i = 0; i < inputs.size(); ++i) {
+        float ratio = 1.f;
+        cv::Mat rawimg;
+        // Tiles always carry their decoded image, a stand-in would lose the tile.
+        bool fused = !inputs[i].yuv.empty() && fuse_yuv && (!fake_input || inputs[i].request || inputs[i].tiled);
+        if (!fused && (!fake_input || inputs[i].request || inputs[i].tiled)) {
+            rawimg = loadImage(inputs[i]);
+            if (rawimg.empty()) {
+                LOG(WARNING) << "Can not decode " << inputs[i].imagename;
+                // Only the image list runs on with a stand-in, so its epoch still completes.
+                if (inputs[i].request || inputs[i].stream || inputs[i].shm) {
+                    failInput(inputs[i], std::make_exception_ptr(std::runtime_error("can not decode the image")));
+                    continue;
+                }
+            }
+        }
+        if (fused) {
+            faceboxes_imgs.emplace_back(faceboxes_preprocess_yuv(inputs[i].yuv, inputs[i].yuv_format,
+                                                                 variant->height, variant->width, ratio));
+        }
+        else if (rawimg.empty()) {
+            // Maybe not CV_8UC3, sized for the largest variant.
+            static std::vector<uint8_t> ones(faceboxes_height * faceboxes_width * 3, 1);
+            cv::Mat fake_img(variant->height, variant->width, CV_8UC3, ones.data());
+            faceboxes_imgs.emplace_back(fake_img);
+        }
+        else if (inputs[i].tiled && inputs[i].tile_x >= 0) {
+            cv::Mat tile(variant->height, variant->width, CV_8UC3);
+            crop<uint8_t>(rawimg.data, rawimg.rows, rawimg.cols, tile.data,
+                          inputs[i].tile_y, inputs[i].tile_x, variant->height, variant->width, 3);
+            ratio = inputs[i].tiled->scale;
+            faceboxes_imgs.emplace_back(tile);
+        }
+        else {
+            cv::Mat rszd_img = faceboxes_preprocess(rawimg, variant->height, variant->width, ratio);
+            if (inputs[i].tiled) {
+                ratio *= inputs[i].tiled->scale;
+            }
+            faceboxes_imgs.emplace_back(rszd_img);
+        }
+        images.emplace_back();
+        ImageMeta &meta = images.back();
+        meta.imagename = std::move(inputs[i].imagename);
+        meta.ratio = ratio;
+        meta.request = std::move(inputs[i].request);
+        meta.stream = std::move(inputs[i].stream);
+        meta.shm = std::move(inputs[i].shm);
+        meta.shm_tag = inputs[i].shm_tag;
+        meta.enqueue_time = inputs[i].enqueue_time;
+        meta.reorder = std::move(inputs[i].reorder);
+        meta.seq = inputs[i].seq;
+        if (inputs[i].tiled) {
+            meta.tiled = std::move(inputs[i].tiled);
+            meta.offset_x = std::max(0, inputs[i].tile_x) / meta.tiled->scale;
+            meta.offset_y = inputs[i].tile_y / meta.tiled->scale;
+        }
+        else if (keep_frames) {
+            meta.frame = fused ? inputs[i].yuv : rawimg;
+            meta.frame_slot = std::move(inputs[i].shm_slot);
+        }
+        charged_bytes += inputs[i].charged_bytes;
+    }
 
-        uint64_t t2 = cnmodel::time();
-        faceBoxesPreprocessTimeQueue.push(t2 - t1);
+    if (images.empty()) {
+        if (in_mlu) {
+            variant->model->freeInput(in_mlu);
+            variant->model->freeOutput(out_mlu);
+        }
+        return true;
+    }
 
-        HostDeviceInputArray faceboxesBatchInput(std::move(faceboxes_imgs), in_mlu, out_mlu);
-        faceboxesBatchInput.imagenames = std::move(images);
-        faceboxesBatchInput.ratios = std::move(ratios);
-        faceBoxesBatchInputQueue.push(std::move(faceboxesBatchInput));
+    std::shared_ptr<uint8_t> imgsptr = copyto<uint8_t>(faceboxes_imgs, batch_size);
+    uint8_t *p_imgsptr = imgsptr.get();
+
+    if (blocking) {
+        // Batches already on the device are not freed once the flow stops, do not wait for them.
+        in_mlu = variant->model->deviceAllocInput(&stopping);
+        out_mlu = in_mlu ? variant->model->deviceAllocOutput(&stopping) : nullptr;
+        if (out_mlu == nullptr) {
+            if (in_mlu) {
+                variant->model->freeInput(in_mlu);
+            }
+            return false;
+        }
     }
+    variant->model->copyin(in_mlu, (void **)&p_imgsptr);
+    // The pixels are on the device now, the batch goes on without them.
+    faceboxes_imgs = std::vector<cv::Mat>();
+    imgsptr.reset();
+
+    uint64_t t2 = cnmodel::time();
+    faceBoxesPreprocessTimeQueue.push_evict(t2 - t1);
+    counted.stop();
+    preprocessStats.images += images.size();
+    ++preprocessStats.batches;
+    preprocessStats.busy_us += t2 - t1;
+
+    // Inputs hold the decoded frames and shared-memory slots, free them before the batch queues.
+    inputs = std::vector<FlowInput>();
+
+    HostDeviceInputArray faceboxesBatchInput(in_mlu, out_mlu);
+    faceboxesBatchInput.images = std::move(images);
+    faceboxesBatchInput.charged_bytes = charged_bytes;
+    faceboxesBatchInput.variant = variant;
+    if (variant->batchQueue.push(std::move(faceboxesBatchInput)) != 0) {
+        variant->model->freeInput(in_mlu);
+        variant->model->freeOutput(out_mlu);
+    }
+    return true;
 }
 
-void CnFlow::addFaceBoxesInfer(int dp) {
+std::shared_ptr<FaceBoxesVariant> CnFlow::addFaceBoxesVariant(const std::string &model_path, const std::string &func_name, int dp) {
+    std::shared_ptr<FaceBoxesVariant> variant(new FaceBoxesVariant);
+    variant->model_path = model_path;
+    variant->func_name = func_name;
+    variant->dp = dp;
+    variant->batchQueue.resize(320);
+
+    // Only read the shapes here, the infer threads load their own replicas.
     bool need_buffer = false;
-    cnmodel::CnModel *moder = new cnmodel::CnModel(faceboxes_model_path.c_str(), faceboxes_func_name.c_str(), device, dp, need_buffer, 0, CNRT_UINT8, CNRT_NHWC);
+    cnmodel::CnModel *moder = new cnmodel::CnModel(model_path.c_str(), func_name.c_str(), device, dp, need_buffer, 0, CNRT_UINT8, CNRT_NHWC);
+    // TODO: maybe not input_shapes[0]
+    variant->height = moder->input_shapes[0].h;
+    variant->width = moder->input_shapes[0].w;
+    variant->batch_size = dp * moder->input_shapes[0].n;
     float batch_size = static_cast<float>(moder->input_shapes[0].n);
-    int num_models = ceil(MAX_CORE_NUM / get_core_num(batch_size));
-    int buffer_size = 2 * num_models;
+    variant->num_models = ceil(MAX_CORE_NUM / get_core_num(batch_size));
 
-    LOG(INFO) << "num models: " << num_models;
-    
+    std::vector<Prior> priors = faceboxes_priors(variant->height, variant->width);
+    // The host data counts are for all n images of a tensor.
+    size_t num_priors = std::min(moder->output_data_counts[0] / moder->output_shapes[0].n / 4,
+                                 moder->output_data_counts[1] / moder->output_shapes[1].n / 2);
+    if (priors.size() != num_priors) {
+        LOG(WARNING) << "expect " << priors.size() << " priors, model outputs " << num_priors;
+        priors.resize(std::min(priors.size(), num_priors));
+    }
+    variant->priors = std::move(priors);
+
+    const cnmodel::Shape &loc = moder->output_shapes[0];
+    const cnmodel::Shape &conf = moder->output_shapes[1];
+    variant->native_heads = native_heads(variant->priors.size(),
+                                         loc.c, loc.h, loc.w, moder->output_aligned_c[0],
+                                         conf.c, conf.h, conf.w, moder->output_aligned_c[1]);
     delete moder;
-    addFaceBoxesInfer(num_models, dp, buffer_size);
+
+    LOG(INFO) << "variant " << model_path << ": " << variant->height << "x" << variant->width
+              << " batch " << variant->batch_size << ", num models: " << variant->num_models;
+
+    faceboxes_height = std::max(faceboxes_height, variant->height);
+    faceboxes_width = std::max(faceboxes_width, variant->width);
+
+    std::shared_ptr<FaceBoxesGroup> group;
+    for (auto &candidate : faceboxesGroups) {
+        if (candidate->height == variant->height && candidate->width == variant->width) {
+            group = candidate;
+        }
+    }
+    if (!group) {
+        group.reset(new FaceBoxesGroup);
+        group->height = variant->height;
+        group->width = variant->width;
+        group->routedQueue.resize(routed_capacity);
+        faceboxesGroups.push_back(group);
+        std::sort(faceboxesGroups.begin(), faceboxesGroups.end(),
+                  [](const std::shared_ptr<FaceBoxesGroup> &a, const std::shared_ptr<FaceBoxesGroup> &b) {
+            return a->height * a->width < b->height * b->width;
+        });
+    }
+    group->variants.push_back(variant);
+    std::sort(group->variants.begin(), group->variants.end(),
+              [](const std::shared_ptr<FaceBoxesVariant> &a, const std::shared_ptr<FaceBoxesVariant> &b) {
+        return a->batch_size < b->batch_size;
+    });
+
+    faceboxesVariants.push_back(variant);
+    return variant;
+}
+
+void CnFlow::showVariantStats() {
+    for (auto &group : faceboxesGroups) {
+        LOG(INFO) << "input " << group->height << "x" << group->width << ": routed " << group->routed;
+    }
+    for (auto &variant : faceboxesVariants) {
+        uint64_t batches = variant->batches;
+        uint64_t images = variant->images;
+        LOG(INFO) << "variant " << variant->model_path
+                  << " " << variant->height << "x" << variant->width << " batch " << variant->batch_size
+                  << ": batches " << batches
+                  << " images " << images
+                  << " fill " << (batches > 0 ? static_cast<double>(images) / (batches * variant->batch_size) : 0.)
+                  << " infer mean " << (batches > 0 ? variant->infer_us / batches : 0) << " us"
+                  << " latency mean " << (images > 0 ? variant->latency_us / images : 0) << " us"
+                  << " max " << variant->max_latency_us << " us";
+    }
+}
+
+void CnFlow::addFaceBoxesInfer(int dp) {
+    if (faceboxesVariants.empty()) {
+        addFaceBoxesVariant(faceboxes_model_path, faceboxes_func_name, dp);
+    }
+    // Expect every replica before the first one can arrive.
+    for (auto &variant : faceboxesVariants) {
+        startup.expect(variant->num_models);
+    }
+    for (auto &variant : faceboxesVariants) {
+        startFaceBoxesInfer(variant, variant->num_models, 2 * variant->num_models);
+    }
 }
 
 void CnFlow::addFaceBoxesInfer(int parallelism, int dp, int buffer_size) {
+    if (faceboxesVariants.empty()) {
+        addFaceBoxesVariant(faceboxes_model_path, faceboxes_func_name, dp);
+    }
+    startup.expect(parallelism * faceboxesVariants.size());
+    for (auto &variant : faceboxesVariants) {
+        startFaceBoxesInfer(variant, parallelism, buffer_size);
+    }
+}
+
+void CnFlow::startFaceBoxesInfer(std::shared_ptr<FaceBoxesVariant> variant, int parallelism, int buffer_size) {
+    inferStats.workers += parallelism;
     bool need_buffer = true;
     for (int i = 0; i < parallelism; ++i) {
-        threads.push_back(new std::thread(&CnFlow::runFaceBoxesInfer, this, dp, need_buffer, parallelism, buffer_size));
+        startThread(std::bind(&CnFlow::runFaceBoxesInfer, this, variant, need_buffer, buffer_size));
         need_buffer = false;
     }
 }
 
-void CnFlow::runFaceBoxesInfer(int dp, bool need_buffer, int parallelism, int buffer_size) {
-    cnmodel::CnModel *moder = new cnmodel::CnModel(faceboxes_model_path.c_str(), faceboxes_func_name.c_str(), device, dp, need_buffer, buffer_size, CNRT_UINT8, CNRT_NHWC);
-
-    // TODO: maybe not input_shapes[0]
-    this->faceboxes_height = moder->input_shapes[0].h;
-    this->faceboxes_width = moder->input_shapes[0].w;
-    //LOG(INFO) << " shape: [" << moder->input_shapes[0].n << ", " << moder->input_shapes[0].c 
+/* Warm a loaded replica up on scratch buffers, publish the one owning the buffers as the model
+ * of the variant, and count the replica in at the startup barrier.
+ */
+void CnFlow::initFaceBoxesModel(std::shared_ptr<FaceBoxesVariant> variant, cnmodel::CnModel *moder, bool need_buffer) {
+    //LOG(INFO) << " shape: [" << moder->input_shapes[0].n << ", " << moder->input_shapes[0].c
     //          << ", " << moder->input_shapes[0].h << ", " << moder->input_shapes[0].w << "]" << std::endl;
-    if (need_buffer)
-        faceboxesModels.push_back(moder);
+    for (int i = 0; i < warmup_invokes; ++i) {
+        void **in_mlu = moder->deviceAllocInput();
+        void **out_mlu = moder->deviceAllocOutput();
+        moder->invoke_ex(in_mlu, out_mlu);
+        moder->freeInput(in_mlu);
+        moder->freeOutput(out_mlu);
+    }
+    if (need_buffer) {
+        variant->model = moder;
+    }
+    if (startup.arrive()) {
+        LOG(INFO) << "models ready " << (startup.openTime() - create_time) / 1000 << " ms after start";
+    }
+}
 
-    while (true) {
-        if (faceBoxesBatchInputQueue.empty()) {
-            // LOG(WARNING) << "faceBoxesBatchInputQueue size == 0";
+/* Scan the foreground scores of every image of a native batch, then copy the location values
+ * of the surviving priors only into the host buffer of the location head.
+ */
+std::vector<std::vector<int>> CnFlow::fetchNativeLocations(cnmodel::CnModel *moder, FaceBoxesVariant *variant,
+                                                           const std::shared_ptr<std::shared_ptr<uint16_t>> &outputs,
+                                                           void **out_mlu, int num_images) {
+    const NativeHeads &heads = variant->native_heads;
+    uint16_t threshold = float_to_half_floor(conf_threshold);
+    const uint16_t *location = outputs.get()[0].get();
+    std::vector<std::vector<int>> survivors(num_images);
+    std::vector<std::pair<size_t, size_t>> ranges;
+    for (int i = 0; i < num_images; ++i) {
+        scan_foreground(nativeImage(moder, outputs, 1, i), heads, threshold, survivors[i]);
+        size_t base = nativeImage(moder, outputs, 0, i) - location;
+        for (int p : survivors[i]) {
+            const uint32_t *offsets = &heads.loc_offsets[p * 4];
+            ranges.push_back({base + *std::min_element(offsets, offsets + 4),
+                              base + *std::max_element(offsets, offsets + 4) + 1});
+        }
+    }
+    moder->copyout_ranges(out_mlu, 0, outputs.get()[0].get(), ranges);
+    return survivors;
+}
+
+/* Image i of a batch in the float output k: dp chunks of n images each. */
+float *CnFlow::floatImage(cnmodel::CnModel *moder, const std::shared_ptr<std::shared_ptr<float>> &outputs, int k, int i) {
+    int n = moder->output_shapes[k].n;
+    size_t image_count = moder->output_data_counts[k] / n;
+    return outputs.get()[k].get() + (i / n) * moder->output_data_counts[k] + (i % n) * image_count;
+}
+
+/* Image i of output k in the raw device outputs: dp chunks of output_data_bytes, n images each. */
+const uint16_t *CnFlow::nativeImage(cnmodel::CnModel *moder, const std::shared_ptr<std::shared_ptr<uint16_t>> &outputs, int k, int i) {
+    const cnmodel::Shape &shape = moder->output_shapes[k];
+    size_t image_halves = static_cast<size_t>(shape.h) * shape.w * moder->output_aligned_c[k];
+    size_t chunk_halves = moder->output_data_bytes[k] / sizeof(uint16_t);
+    return outputs.get()[k].get() + (i / shape.n) * chunk_halves + (i % shape.n) * image_halves;
+}
+
+void CnFlow::runFaceBoxesInfer(std::shared_ptr<FaceBoxesVariant> variant, bool need_buffer, int buffer_size) {
+    cnmodel::CnModel *moder = new cnmodel::CnModel(variant->model_path.c_str(), variant->func_name.c_str(), device, variant->dp, need_buffer, buffer_size, CNRT_UINT8, CNRT_NHWC);
+    initFaceBoxesModel(variant, moder, need_buffer);
+
+    while (!stopping) {
+        if (variant->batchQueue.empty()) {
+            // LOG(WARNING) << "batchQueue size == 0";
         }
 
-        auto faceboxesinput = faceBoxesBatchInputQueue.pop();
+        auto faceboxesinput = variant->batchQueue.pop();
+        if (stopping) {
+            break;
+        }
 
+        perfstat::Scope counted(stage_counters ? &inferCounters : nullptr);
+        counted.addImages(faceboxesinput.images.size());
         uint64_t t1 = cnmodel::time();
 
-        auto img = faceboxesinput.hosts;
         void **_input_mlu_ptrS = faceboxesinput.in_mlu_ptr;
         void **_output_mlu_ptrS = faceboxesinput.out_mlu_ptr;
         moder->invoke_ex(_input_mlu_ptrS, _output_mlu_ptrS);
 
         uint64_t t2 = cnmodel::time();
-        FaceBoxesInferTimeQueue.push(t2 - t1);
+        FaceBoxesInferTimeQueue.push_evict(t2 - t1);
+        variant->infer_us += t2 - t1;
+        counted.stop();
+        inferStats.images += faceboxesinput.images.size();
+        ++inferStats.batches;
+        inferStats.busy_us += t2 - t1;
 
-        Host_DeviceInputArray faceboxesoutput(std::move(img), _input_mlu_ptrS, _output_mlu_ptrS);
-        faceboxesoutput.imagenames = std::move(faceboxesinput.imagenames);
-        faceboxesoutput.ratios = std::move(faceboxesinput.ratios);
+        Host_DeviceInputArray faceboxesoutput(_input_mlu_ptrS, _output_mlu_ptrS);
+        faceboxesoutput.images = std::move(faceboxesinput.images);
+        faceboxesoutput.charged_bytes = faceboxesinput.charged_bytes;
+        faceboxesoutput.variant = variant;
 
         if (faceboxesOutputQueue.full()) {
             LOG(WARNING) << "faceboxesOutputQueue is full";
@@ -183,96 +1474,346 @@ void CnFlow::runFaceBoxesInfer(int dp, bool need_buffer, int parallelism, int bu
     }
 }
 
+void CnFlow::addFaceBoxesInferAsync(int dp, int num_drivers) {
+    if (faceboxesVariants.empty()) {
+        addFaceBoxesVariant(faceboxes_model_path, faceboxes_func_name, dp);
+    }
+    for (auto &variant : faceboxesVariants) {
+        startup.expect(variant->num_models);
+    }
+    for (auto &variant : faceboxesVariants) {
+        int num_models = variant->num_models;
+        int buffer_size = 2 * num_models;
+        inferStats.workers += num_models;
+        int drivers = std::max(1, std::min(num_drivers, num_models));
+        for (int i = 0; i < drivers; ++i) {
+            int num_replicas = num_models / drivers + (i < num_models % drivers ? 1 : 0);
+            startThread(std::bind(&CnFlow::runFaceBoxesInferAsync, this, variant, i == 0, num_replicas, buffer_size));
+        }
+    }
+}
+
+void CnFlow::runFaceBoxesInferAsync(std::shared_ptr<FaceBoxesVariant> variant, bool need_buffer, int num_replicas, int buffer_size) {
+    struct Slot {
+        cnmodel::CnModel *moder;
+        bool busy;
+        Host_DeviceInputArray batch;
+    };
+
+    // Load and warm the replicas in parallel, the driver only starts once all of them are ready.
+    std::vector<Slot> slots(num_replicas);
+    std::vector<std::thread> loaders;
+    for (int i = 0; i < num_replicas; ++i) {
+        loaders.emplace_back([this, &slots, variant, need_buffer, buffer_size, i]() {
+            bool owner = need_buffer && i == 0;
+            slots[i].moder = new cnmodel::CnModel(variant->model_path.c_str(), variant->func_name.c_str(), device, variant->dp, owner, buffer_size, CNRT_UINT8, CNRT_NHWC);
+            slots[i].busy = false;
+            initFaceBoxesModel(variant, slots[i].moder, owner);
+        });
+    }
+    for (auto &loader : loaders) {
+        loader.join();
+    }
+    setdevice(device);
+
+    while (!stopping) {
+        bool worked = false;
+        // Only passes that completed or launched a batch are counted, not the idle polling.
+        perfstat::Scope counted(stage_counters ? &inferCounters : nullptr);
+        for (auto &slot : slots) {
+            if (slot.busy && slot.moder->done()) {
+                // Keep the batch on the card until postprocess has room for it.
+                if (faceboxesOutputQueue.try_push(slot.batch) != 0) {
+                    continue;
+                }
+                // Device time between the events around the invocation, not the polling delay.
+                uint64_t elapsed = static_cast<uint64_t>(slot.moder->elapsed() * 1000);
+                FaceBoxesInferTimeQueue.push_evict(elapsed);
+                variant->infer_us += elapsed;
+                inferStats.images += slot.batch.images.size();
+                ++inferStats.batches;
+                inferStats.busy_us += elapsed;
+                slot.batch = Host_DeviceInputArray();
+                slot.busy = false;
+                worked = true;
+            }
+            if (!slot.busy) {
+                bool ret;
+                slot.batch = variant->batchQueue.pop_ex(ret);
+                if (!ret) {
+                    continue;
+                }
+                slot.moder->invoke_async(slot.batch.in_mlu_ptr, slot.batch.out_mlu_ptr);
+                slot.busy = true;
+                worked = true;
+                counted.addImages(slot.batch.images.size());
+            }
+        }
+        if (!worked) {
+            counted.cancel();
+            USLEEP(20);
+        }
+    }
+    // Do not leave invocations running on the buffers of a stopped flow.
+    for (auto &slot : slots) {
+        while (slot.busy && !slot.moder->done()) {
+            USLEEP(20);
+        }
+    }
+}
+
 void CnFlow::addFaceBoxesPostProcess(int parallelism) {
+    postprocessStats.workers += parallelism;
     for (int i = 0; i < parallelism; ++i) {
-        threads.push_back(new std::thread(&CnFlow::runFaceBoxesPostProcess, this));
+        if (executor) {
+            executor->addRecurring([this]() { return stepFaceBoxesPostProcess(false); });
+        }
+        else {
+            startThread(std::bind(&CnFlow::runFaceBoxesPostProcess, this));
+        }
     }
 }
 
 void CnFlow::runFaceBoxesPostProcess() {
     setdevice(device);
+    if (!startup.wait()) {
+        return;
+    }
 
-    do {
-        USLEEP(100);
-    } while (faceboxesModels.size() <= 0);
+    while (!stopping) {
+        stepFaceBoxesPostProcess(true);
+    }
+}
 
-    while (true) {
-        auto faceboxesoutput = faceboxesOutputQueue.pop();
+/* Postprocess one batch, a non-blocking step returns false when there is no output. */
+bool CnFlow::stepFaceBoxesPostProcess(bool blocking) {
+    if (!modelsReady()) {
+        return false;
+    }
 
-        uint64_t t1 = cnmodel::time();
+    Host_DeviceInputArray faceboxesoutput;
+    if (blocking) {
+        faceboxesoutput = faceboxesOutputQueue.pop();
+        if (stopping) {
+            return false;
+        }
+    }
+    else {
+        bool ret;
+        faceboxesoutput = faceboxesOutputQueue.pop_ex(ret);
+        if (!ret) {
+            return false;
+        }
+    }
+
+    perfstat::Scope counted(stage_counters ? &postprocessCounters : nullptr);
+    counted.addImages(faceboxesoutput.images.size());
+    uint64_t t1 = cnmodel::time();
 
-        std::shared_ptr<std::shared_ptr<float>> faceboxes = faceboxesModels[0]->copyout(faceboxesoutput.out_mlu_ptr);
-        faceboxesModels[0]->freeInput(faceboxesoutput.in_mlu_ptr);
-        faceboxesModels[0]->freeOutput(faceboxesoutput.out_mlu_ptr);
-
-        auto images = faceboxesoutput.hosts;
-        auto imagenames = faceboxesoutput.imagenames;
-        auto ratios = faceboxesoutput.ratios;
-        for (int i = 0; i < images.size(); i++) {
-            float *location = faceboxes.get()[0].get() + i * faceboxesModels[0]->output_data_counts[0];
-            float *confidence = faceboxes.get()[1].get() + i * faceboxesModels[0]->output_data_counts[1];
-
-            /* auto boxes = postprocess(boxes) */
-            
-            Host_DeviceInput empty_data;
-            faceboxesPostQueue.push(std::move(empty_data));
-            timeQueue.push(cnmodel::time());
-
-            if (imagenames[i] == imagePath[i]) {
-                int data_count = faceboxesModels[0]->output_data_counts[0];
-                if (model_output.size() == 0) {
-                    model_output.resize(data_count);
-                    memcpy(model_output.data(), location, sizeof(float) * data_count);
+    FaceBoxesVariant *variant = faceboxesoutput.variant.get();
+    cnmodel::CnModel *moder = variant->model;
+    std::shared_ptr<std::shared_ptr<float>> faceboxes;
+    std::shared_ptr<std::shared_ptr<uint16_t>> faceboxes_native;
+    std::vector<std::vector<int>> survivors;
+    auto &images = faceboxesoutput.images;
+    if (native_output) {
+        // The whole confidence head, then only the location rows of the priors that pass.
+        faceboxes_native = moder->copyout_native(faceboxesoutput.out_mlu_ptr, {false, true});
+        survivors = fetchNativeLocations(moder, variant, faceboxes_native, faceboxesoutput.out_mlu_ptr, images.size());
+    }
+    else {
+        faceboxes = moder->copyout(faceboxesoutput.out_mlu_ptr);
+    }
+    moder->freeInput(faceboxesoutput.in_mlu_ptr);
+    moder->freeOutput(faceboxesoutput.out_mlu_ptr);
+
+    int finished = 0;
+    // Tiles hold no budget, their image returns it with its last tile.
+    int released = 0;
+    size_t released_bytes = faceboxesoutput.charged_bytes;
+    for (int i = 0; i < images.size(); i++) {
+        float *location = nullptr;
+        Detections boxes;
+        if (native_output) {
+            boxes = faceboxes_decode_native(nativeImage(moder, faceboxes_native, 0, i), nativeImage(moder, faceboxes_native, 1, i),
+                                            variant->native_heads, survivors[i], variant->priors,
+                                            variant->height, variant->width, images[i].ratio,
+                                            conf_threshold, nms_threshold, keep_top_k);
+        }
+        else {
+            location = floatImage(moder, faceboxes, 0, i);
+            float *confidence = floatImage(moder, faceboxes, 1, i);
+            boxes = faceboxes_postprocess(location, confidence, variant->priors,
+                                          variant->height, variant->width, images[i].ratio,
+                                          conf_threshold, nms_threshold, keep_top_k);
+        }
+
+        ImageMeta &meta = images[i];
+        uint64_t enqueue_time = meta.enqueue_time;
+        uint64_t variant_latency = cnmodel::time() - enqueue_time;
+        variant->latency_us += variant_latency;
+        uint64_t variant_max_latency = variant->max_latency_us;
+        while (variant_latency > variant_max_latency && !variant->max_latency_us.compare_exchange_weak(variant_max_latency, variant_latency)) {}
+
+        if (meta.tiled) {
+            size_t tiled_bytes = meta.tiled->charged_bytes;
+            if (!mergeTile(meta, boxes)) {
+                continue;
+            }
+            released_bytes += tiled_bytes;
+        }
+        ++released;
+
+        // Whatever leaves the flow goes through the reorder buffer of the source, if it has one.
+        std::shared_ptr<FlowRequest> request = meta.request;
+        std::shared_ptr<VideoStream> stream = meta.stream;
+        std::shared_ptr<ShmSource> shm = meta.shm;
+        uint64_t shm_tag = meta.shm_tag;
+        std::string imagename = meta.imagename;
+        auto deliver = [this, boxes, imagename, request, stream, shm, shm_tag, enqueue_time]() mutable {
+            if (sink) {
+                cnsink::SinkRecord record;
+                record.id = result_id++;
+                record.imagename = imagename;
+                record.boxes = boxes;
+                sink->put(std::move(record));
+            }
+            if (request) {
+                requestLatencyQueue.push_evict(cnmodel::time() - request->submit_time);
+                request->promise.set_value(std::move(boxes));
+            }
+            else if (stream) {
+                uint64_t latency = cnmodel::time() - enqueue_time;
+                ++stream->detected;
+                stream->latency_us += latency;
+                uint64_t max_latency = stream->max_latency_us;
+                while (latency > max_latency && !stream->max_latency_us.compare_exchange_weak(max_latency, latency)) {}
+            }
+            else if (shm) {
+                // Never wait for a producer that stopped reading its responses.
+                if (shmring::putResponse(shm->responses, shm_tag, boxes)) {
+                    ++shm->answered;
                 }
                 else {
-                    for (int k = 0; k < data_count; ++k) {
-                        if (model_output[k] != location[k]) {
-                            // LOG(ERROR) << k << " Model output error: " << model_output[k] << " vs. " << location[k];
-                        }
+                    ++shm->dropped;
+                }
+            }
+        };
+        uint64_t no_result = 0;
+        if (first_result_time == 0 && first_result_time.compare_exchange_strong(no_result, cnmodel::time())) {
+            LOG(INFO) << "first result " << (first_result_time - create_time) / 1000 << " ms after start";
+        }
+        if (meta.reorder) {
+            meta.reorder->put(meta.seq, deliver);
+        }
+        else {
+            deliver();
+        }
+        if (request || stream || shm) {
+            continue;
+        }
+
+        finished = ++num_finished;
+        if (finished == num_input / 3) {
+            one_thrid_time = cnmodel::time();
+        }
+        if (finished == num_input / 3 * 2) {
+            two_thrid_time = cnmodel::time();
+        }
+
+        // Batches finish in any order, so compare the outputs of the first image of the list.
+        if (location != nullptr && meta.imagename == imagePath[0]) {
+            int data_count = moder->output_data_counts[0] / moder->output_shapes[0].n;
+            if (model_output.size() == 0) {
+                model_output.resize(data_count);
+                memcpy(model_output.data(), location, sizeof(float) * data_count);
+            }
+            else {
+                for (int k = 0; k < data_count; ++k) {
+                    if (model_output[k] != location[k]) {
+                        // LOG(ERROR) << k << " Model output error: " << model_output[k] << " vs. " << location[k];
                     }
                 }
             }
         }
+    }
 
-        uint64_t t2 = cnmodel::time();
-        FaceBoxesPostProcessTimeQueue.push(t2 - t1);
+    admission.release(released, released_bytes);
+    ++variant->batches;
+    variant->images += images.size();
 
-        if (num_input == faceboxesPostQueue.size()) {
-            auto current_time = cnmodel::time();
+    uint64_t t2 = cnmodel::time();
+    FaceBoxesPostProcessTimeQueue.push_evict(t2 - t1);
+    counted.stop();
+    postprocessStats.images += images.size();
+    ++postprocessStats.batches;
+    postprocessStats.busy_us += t2 - t1;
+    ++num_post_batches;
 
-            double ptv = static_cast<double>(current_time - time_start) / static_cast<double>(num_input);
-            printf("sec: %ld us\n", current_time - time_start);
-            printf("qps: %lf\n", 1000000. / ptv);
+    if (num_input > 0 && finished == num_input) {
+        auto current_time = cnmodel::time();
 
-            auto _start_cnt = num_input / 3;
-            auto _end_cnt = num_input / 3 * 2;
-            auto _tstart = timeQueue[_start_cnt];
-            auto _tend = timeQueue[_end_cnt];
+        double ptv = static_cast<double>(current_time - time_start) / static_cast<double>(num_input);
+        printf("sec: %ld us\n", current_time - time_start);
+        printf("qps: %lf\n", 1000000. / ptv);
 
-            double full_ptv = static_cast<double>(_tend - _tstart) / static_cast<double>(_end_cnt - _start_cnt);
-            printf("full-utili qps: %lf\n", 1000000. / full_ptv);
+        auto _start_cnt = num_input / 3;
+        auto _end_cnt = num_input / 3 * 2;
 
-            faceboxesPostQueue.reset();
-            timeQueue.reset();
+        double full_ptv = static_cast<double>(two_thrid_time - one_thrid_time) / static_cast<double>(_end_cnt - _start_cnt);
+        printf("full-utili qps: %lf\n", 1000000. / full_ptv);
 
-            if (--epoch != 0) {
-                putImageList(imagePath, epoch);
-            }
-            else {
-                auto in_mlu = faceboxesModels[0]->deviceAllocInput();
-                auto out_mlu = faceboxesModels[0]->deviceAllocOutput();
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        printf("context switches: voluntary %ld involuntary %ld\n", usage.ru_nvcsw, usage.ru_nivcsw);
+        printf("peak rss: %ld MB\n", usage.ru_maxrss / 1024);
+        if (executor) {
+            printf("executor: %d workers, %lu tasks, %lu stolen\n",
+                   executor->size(), (uint64_t)executor->executed, (uint64_t)executor->stolen);
+        }
+        uint64_t d2h_bytes = 0;
+        for (auto &v : faceboxesVariants) {
+            d2h_bytes += v->model->d2h_bytes;
+        }
+        printf("postprocess: %.1lf us/batch, d2h %.0lf bytes/batch\n", queueMean(FaceBoxesPostProcessTimeQueue),
+               static_cast<double>(d2h_bytes) / std::max<uint64_t>(1, num_post_batches));
+        showVariantStats();
+        if (tiling) {
+            showTileStats();
+        }
+        showAdmission();
+        if (imageListReorder) {
+            imageListReorder->drain();
+        }
+        showReorderStats();
+        if (stage_counters) {
+            showStageCounters();
+        }
+        cnmodel::DevicePool::get(device)->show();
+
+        if (--epoch != 0) {
+            putImageList(imagePath, epoch);
+        }
+        else {
+            for (auto &v : faceboxesVariants) {
+                auto in_mlu = v->model->deviceAllocInput();
+                auto out_mlu = v->model->deviceAllocOutput();
                 float ptv;
-                faceboxesModels[0]->invoke_ex(in_mlu, out_mlu, &ptv);
-                faceboxesModels[0]->freeInput(in_mlu);
-                faceboxesModels[0]->freeOutput(out_mlu);
+                v->model->invoke_ex(in_mlu, out_mlu, &ptv);
+                v->model->freeInput(in_mlu);
+                v->model->freeOutput(out_mlu);
 
-                LOG(INFO) << "model " << faceboxesModels[0]->modelpath << " latency: " << ptv;
-                LOG(INFO) << "Finish";
-                cnrtDestroy();
-                exit(0);
+                LOG(INFO) << "model " << v->model->modelpath << " latency: " << ptv;
+            }
+            if (sink) {
+                sink->close();
             }
+            LOG(INFO) << "Finish";
+            cnrtDestroy();
+            exit(0);
         }
-    }    
+    }
+    return true;
 }
 
 }  // namespace mlu
@@ -1,3 +1,5 @@
+#include <algorithm>
+
 #include "cnmodel.h"
 #include "tsque.h"
 
@@ -27,48 +29,178 @@ cnrtRet_t cnrtMallocBuffer(uint32_t frame_num,
     return CNRT_RET_SUCCESS;
 }
 
-CnMemManager::CnMemManager(size_t num_buffers, std::vector<size_t> size_in_bytes) {
-    n_size = size_in_bytes.size();
-    for (int i = 0; i < num_buffers; ++i) {
-        void **ptrs;
-        ptrs = (void **)malloc(sizeof(void *) * n_size);
-        for (int n = 0; n < n_size; ++n) {
-            void *ptr = nullptr;
-            CNRT_CHECK_V2(cnrtMalloc(&ptr, size_in_bytes[n]));
-            // CNRT_CHECK_V2(cnrtMallocBuffer(1, size_in_bytes[n], 1, &ptr));
-            ptrs[n] = ptr;
+DevicePool *DevicePool::get(int device) {
+    static std::mutex pools_locker;
+    static std::map<int, DevicePool *> pools;
+    std::lock_guard<std::mutex> lock(pools_locker);
+    DevicePool *&pool = pools[device];
+    if (pool == nullptr) {
+        pool = new DevicePool(device);
+    }
+    return pool;
+}
+
+DevicePool::DevicePool(int device): device(device) {
+    counters.capacity_bytes = capacity;
+}
+
+void DevicePool::setCapacity(size_t bytes) {
+    std::lock_guard<std::mutex> lock(locker);
+    capacity = bytes;
+    counters.capacity_bytes = bytes;
+}
+
+/* 64KB minimum, then 4 classes per power of two, so at most 25% of a block is wasted. */
+size_t DevicePool::sizeClass(size_t bytes) {
+    const size_t min_class = 64 * 1024;
+    if (bytes <= min_class) {
+        return min_class;
+    }
+    size_t octave = min_class;
+    while (octave * 2 <= bytes) {
+        octave *= 2;
+    }
+    return ALIGN_UP(bytes, octave / 4);
+}
+
+/* Gives idle blocks back to the device until needed more bytes fit the capacity, all of them for SIZE_MAX. */
+void DevicePool::releaseIdle(size_t needed) {
+    for (auto &it : free_blocks) {
+        while ((needed == SIZE_MAX || counters.allocated_bytes + needed > capacity) && !it.second.empty()) {
+            CNRT_CHECK_V2(cnrtFree(it.second.back()));
+            it.second.pop_back();
+            counters.allocated_bytes -= it.first;
         }
-        buffer.push(ptrs);
     }
 }
 
-CnMemManager::CnMemManager(size_t num_buffers, cnrtDataDescArray_t dataDescArray, int array_length, int dp) {
-    for (int i = 0; i < num_buffers; ++i) {
-        void **ptrs;
-        CNRT_CHECK_V2(cnrtMallocBatchByDescArray(&ptrs,
-                                                dataDescArray,
-                                                array_length,
-                                                dp));
-        buffer.push(ptrs);
+void *DevicePool::tryAlloc(size_t size_class, bool &exhausted, bool &out_of_memory) {
+    auto &blocks = free_blocks[size_class];
+    if (!blocks.empty()) {
+        void *ptr = blocks.back();
+        blocks.pop_back();
+        return ptr;
     }
+
+    // Make room by giving idle blocks of other classes back to the device.
+    releaseIdle(size_class);
+    if (counters.allocated_bytes + size_class > capacity) {
+        exhausted = true;
+        return nullptr;
+    }
+
+    void *ptr = nullptr;
+    if (cnrtMalloc(&ptr, size_class) != CNRT_RET_SUCCESS) {
+        // The card holds less than the capacity, e.g. other processes use it too. Give every idle
+        // block back and retry; failing that, wait for a free like at the capacity, which stays as
+        // configured since the memory may come back.
+        releaseIdle(SIZE_MAX);
+        if (cnrtMalloc(&ptr, size_class) != CNRT_RET_SUCCESS) {
+            exhausted = true;
+            out_of_memory = true;
+            return nullptr;
+        }
+    }
+    counters.allocated_bytes += size_class;
+    return ptr;
 }
 
-CnMemManager::~CnMemManager() {
-    while (buffer.size() > 0) {
-        void **ptrs = buffer.pop();
-        for (int n = 0; n < n_size; ++n) {
-            CNRT_CHECK_V2(cnrtFree(ptrs[n]));
+bool DevicePool::alloc(const std::vector<size_t> &bytes, void **ptrs, bool blocking,
+                       const std::atomic<bool> *abort) {
+    std::vector<size_t> size_classes;
+    size_t total = 0;
+    for (size_t bytes_n : bytes) {
+        size_classes.push_back(sizeClass(bytes_n));
+        total += size_classes.back();
+    }
+    uint64_t t1 = 0;
+    bool counted = false;
+    int failed_oom = 0;
+
+    locker.lock();
+    CHECK(total <= capacity) << "device " << device << " batch of " << total
+                             << " bytes never fits the pool capacity of " << capacity << " bytes";
+    while (true) {
+        bool exhausted = false;
+        bool out_of_memory = false;
+        size_t n = 0;
+        for (; n < size_classes.size(); ++n) {
+            ptrs[n] = tryAlloc(size_classes[n], exhausted, out_of_memory);
+            if (ptrs[n] == nullptr) {
+                break;
+            }
         }
-        free(ptrs);
+        if (n == size_classes.size()) {
+            break;
+        }
+        // Put the blocks taken so far back, waiting on them could deadlock against other batches.
+        for (size_t k = 0; k < n; ++k) {
+            free_blocks[size_classes[k]].push_back(ptrs[k]);
+        }
+        if (out_of_memory) {
+            // The first miss may only have been blocks of this batch held back, a second one with
+            // nothing outstanding can never be satisfied.
+            if (counters.outstanding_bytes == 0 && failed_oom++ > 0) {
+                LOG(FATAL) << "device " << device << " out of memory for a batch of " << total
+                           << " bytes with nothing outstanding";
+            }
+            LOG_FIRST_N(WARNING, 1) << "device " << device << " out of memory at "
+                                    << counters.allocated_bytes << " bytes, waiting for frees";
+        }
+        if (!counted) {
+            counted = true;
+            ++counters.exhausted;
+            if (blocking) {
+                ++counters.waits;
+                t1 = time();
+            }
+        }
+        if (!blocking || (abort && *abort)) {
+            locker.unlock();
+            return false;
+        }
+        locker.unlock();
+        USLEEP(100);
+        locker.lock();
     }
+
+    if (t1 != 0) {
+        counters.wait_us += time() - t1;
+    }
+    for (size_t n = 0; n < size_classes.size(); ++n) {
+        outstanding[ptrs[n]] = size_classes[n];
+        ++counters.allocs;
+        ++counters.outstanding_blocks;
+        counters.outstanding_bytes += size_classes[n];
+    }
+    counters.high_water_bytes = std::max(counters.high_water_bytes, counters.outstanding_bytes);
+    locker.unlock();
+    return true;
+}
+
+void DevicePool::free(void *ptr) {
+    std::lock_guard<std::mutex> lock(locker);
+    auto it = outstanding.find(ptr);
+    CHECK(it != outstanding.end()) << "free of unknown device block " << ptr;
+    free_blocks[it->second].push_back(ptr);
+    --counters.outstanding_blocks;
+    counters.outstanding_bytes -= it->second;
+    outstanding.erase(it);
 }
 
-void **CnMemManager::pop() {
-    return buffer.pop();
+DevicePoolStats DevicePool::stats() {
+    std::lock_guard<std::mutex> lock(locker);
+    return counters;
 }
 
-void CnMemManager::push(void **ptrs) {
-    buffer.push(ptrs);
+void DevicePool::show() {
+    DevicePoolStats st = stats();
+    LOG(INFO) << "device " << device << " pool: allocated " << st.allocated_bytes
+              << " outstanding " << st.outstanding_bytes << " (" << st.outstanding_blocks << " blocks)"
+              << " high-water " << st.high_water_bytes
+              << " allocs " << st.allocs
+              << " waits " << st.waits << " (" << st.wait_us << " us)"
+              << " exhausted " << st.exhausted;
 }
 
 CnModel::CnModel(const char *_modelpath, const char *_funcname, 
@@ -126,12 +258,9 @@ CnModel::CnModel(const char *_modelpath, const char *_funcname,
 
     LOG(INFO) << "buffer size: " << buffer_size;
 
-    std::vector<size_t> ibytes;
     for (int i = 0; i < input_num; ++i) {
-        ibytes.push_back(dp * input_data_bytes[i]);
+        input_batch_bytes.push_back(dp * input_data_bytes[i]);
     }
-    if (buffer_size > 0 && need_buffer)
-        input_buffer = new CnMemManager(buffer_size, input_descS, input_num, dp);
     for (int i = 0; i < output_num; ++i) {
         int data_count;
         cnrtDataDesc_t data_desc = output_descS[i];
@@ -143,13 +272,48 @@ CnModel::CnModel(const char *_modelpath, const char *_funcname,
         CNRT_CHECK_V2(cnrtGetDataShape(data_desc, &n, &c, &h, &w));
         int data_size = n * h * w * ALIGN_UP(c, 128 / sizeof(uint16_t));
         output_data_bytes.push_back(ALIGN_UP(sizeof(uint16_t) * data_size, 64 * 1024));
+
+        Shape shape;
+        shape.n = n;
+        shape.c = c;
+        shape.h = h;
+        shape.w = w;
+        output_shapes.push_back(shape);
+        output_aligned_c.push_back(ALIGN_UP(c, 128 / sizeof(uint16_t)));
     }
-    std::vector<size_t> obytes;
     for (int i = 0; i < output_num; ++i) {
-        obytes.push_back(dp * output_data_bytes[i]);
+        output_batch_bytes.push_back(dp * output_data_bytes[i]);
+    }
+
+    // Warm the shared pool with buffer_size batches, it grows on demand beyond that.
+    pool = DevicePool::get(device);
+    if (buffer_size > 0 && need_buffer) {
+        std::vector<void **> warm;
+        for (int i = 0; i < buffer_size; ++i) {
+            warm.push_back(deviceAllocInput());
+            warm.push_back(deviceAllocOutput());
+        }
+        for (int i = 0; i < buffer_size; ++i) {
+            freeInput(warm[2 * i]);
+            freeOutput(warm[2 * i + 1]);
+        }
+    }
+}
+
+void **CnModel::allocBlocks(const std::vector<size_t> &bytes, bool blocking, const std::atomic<bool> *abort) {
+    void **ptrs = (void **)malloc(sizeof(void *) * bytes.size());
+    if (!pool->alloc(bytes, ptrs, blocking, abort)) {
+        free(ptrs);
+        return nullptr;
     }
-    if (buffer_size > 0 && need_buffer)
-        output_buffer = new CnMemManager(buffer_size, output_descS, output_num, dp);
+    return ptrs;
+}
+
+void CnModel::freeBlocks(void **ptrs, int num) {
+    for (int n = 0; n < num; ++n) {
+        pool->free(ptrs[n]);
+    }
+    free(ptrs);
 }
 
 void CnModel::invoke_ex(void **_input_mlu_ptrS, void **_output_mlu_ptrS) {
@@ -184,12 +348,50 @@ void CnModel::invoke_ex(void **_input_mlu_ptrS, void **_output_mlu_ptrS, float *
     CNRT_CHECK_V2(cnrtEventElapsedTime(event_start, event_end, ptv));
 }
 
-void **CnModel::deviceAllocInput() {
-    return input_buffer->pop();
+void CnModel::invoke_async(void **_input_mlu_ptrS, void **_output_mlu_ptrS) {
+    void *param[input_num + output_num]; 
+    for (int i = 0; i < input_num; ++i){
+        param[i] = _input_mlu_ptrS[i];
+    }
+    for (int i = 0; i < output_num; ++i){
+        param[input_num + i] = _output_mlu_ptrS[i];
+    }
+
+    CNRT_CHECK_V2(cnrtPlaceEvent(event_start, stream));
+    CNRT_CHECK_V2(cnrtInvokeFunction(function, dim, param, func_type, stream, (void *)&invoke_func_param));
+    CNRT_CHECK_V2(cnrtPlaceEvent(event_end, stream));
+}
+
+bool CnModel::done() {
+    cnrtRet_t status = cnrtQueryStream(stream);
+    if (status == CNRT_RET_ERR_BUSY) {
+        return false;
+    }
+    // A failed invocation is fatal like any other CNRT error, its batch would never complete.
+    CNRT_CHECK_V2(status);
+    return true;
+}
+
+float CnModel::elapsed() {
+    float ms = 0;
+    CNRT_CHECK_V2(cnrtEventElapsedTime(event_start, event_end, &ms));
+    return ms;
 }
 
-void **CnModel::deviceAllocOutput() {
-    return output_buffer->pop();
+void **CnModel::deviceAllocInput(const std::atomic<bool> *abort) {
+    return allocBlocks(input_batch_bytes, true, abort);
+}
+
+void **CnModel::deviceAllocOutput(const std::atomic<bool> *abort) {
+    return allocBlocks(output_batch_bytes, true, abort);
+}
+
+void **CnModel::tryDeviceAllocInput() {
+    return allocBlocks(input_batch_bytes, false);
+}
+
+void **CnModel::tryDeviceAllocOutput() {
+    return allocBlocks(output_batch_bytes, false);
 }
 
 void CnModel::copyin(void **mlu_ptr, void **cpu_ptr) {
@@ -208,16 +410,52 @@ std::shared_ptr<std::shared_ptr<float>> CnModel::copyout(void **mlu_ptr) {
 
     // CNRT_CHECK_V2(cnrtMemcpyBatchByDescArray(output_cpu_ptrS.data(), mlu_ptr, 
     //     output_descS, output_num, dp, CNRT_MEM_TRANS_DIR_DEV2HOST));
+    // The copy is disabled, nothing is counted in d2h_bytes until it moves bytes again.
     return s_output_cpu_ptrS;
 }
 
+std::shared_ptr<std::shared_ptr<uint16_t>> CnModel::copyout_native(void **mlu_ptr, const std::vector<bool> &copy) {
+    std::shared_ptr<std::shared_ptr<uint16_t>> s_output_cpu_ptrS(new std::shared_ptr<uint16_t>[output_num], [](std::shared_ptr<uint16_t> *ptr){delete [] ptr;});
+    for (int i = 0; i < output_num; ++i) {
+        std::shared_ptr<uint16_t> s_output_ptr(new uint16_t[output_batch_bytes[i] / sizeof(uint16_t)], [](uint16_t *ptr){delete [] ptr;});
+        if (copy.empty() || (i < copy.size() && copy[i])) {
+            CNRT_CHECK_V2(cnrtMemcpy(s_output_ptr.get(), mlu_ptr[i], output_batch_bytes[i], CNRT_MEM_TRANS_DIR_DEV2HOST));
+            d2h_bytes += output_batch_bytes[i];
+        }
+        s_output_cpu_ptrS.get()[i] = s_output_ptr;
+    }
+    return s_output_cpu_ptrS;
+}
+
+void CnModel::copyout_ranges(void **mlu_ptr, int k, uint16_t *host, std::vector<std::pair<size_t, size_t>> ranges) {
+    // A copy costs about as much as a few hundred bytes of transfer, bridge gaps below that.
+    const size_t max_gap = 256;
+    std::sort(ranges.begin(), ranges.end());
+    size_t n = 0;
+    for (size_t i = 1; i < ranges.size(); ++i) {
+        if (ranges[i].first <= ranges[n].second + max_gap) {
+            ranges[n].second = std::max(ranges[n].second, ranges[i].second);
+        }
+        else {
+            ranges[++n] = ranges[i];
+        }
+    }
+    ranges.resize(ranges.empty() ? 0 : n + 1);
+    for (auto &range : ranges) {
+        size_t bytes = (range.second - range.first) * sizeof(uint16_t);
+        void *src = static_cast<char *>(mlu_ptr[k]) + range.first * sizeof(uint16_t);
+        CNRT_CHECK_V2(cnrtMemcpy(host + range.first, src, bytes, CNRT_MEM_TRANS_DIR_DEV2HOST));
+        d2h_bytes += bytes;
+    }
+}
+
 
 void CnModel::freeInput(void **input_mlu) {
-    input_buffer->push(input_mlu);
+    freeBlocks(input_mlu, input_num);
 }
 
 void CnModel::freeOutput(void **output_mlu) {
-    output_buffer->push(output_mlu);
+    freeBlocks(output_mlu, output_num);
 }
 
 std::shared_ptr<std::shared_ptr<float>> CnModel::invoke(void **ptr) {
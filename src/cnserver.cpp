@@ -0,0 +1,205 @@
+#include "cnserver.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+
+namespace cnserver {
+
+// Reject absurd frames instead of allocating whatever the peer asks for.
+static const uint32_t MAX_REQUEST_BYTES = 64 * 1024 * 1024;
+
+bool readAll(int fd, void *buf, size_t nbytes) {
+    char *p = static_cast<char *>(buf);
+    while (nbytes > 0) {
+        ssize_t n = read(fd, p, nbytes);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        nbytes -= n;
+    }
+    return true;
+}
+
+bool writeAll(int fd, const void *buf, size_t nbytes) {
+    const char *p = static_cast<const char *>(buf);
+    while (nbytes > 0) {
+        ssize_t n = send(fd, p, nbytes, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        nbytes -= n;
+    }
+    return true;
+}
+
+int connectLoopback(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+bool sendRequest(int fd, const std::vector<uchar> &encoded) {
+    uint32_t nbytes = encoded.size();
+    return writeAll(fd, &nbytes, sizeof(nbytes)) && writeAll(fd, encoded.data(), nbytes);
+}
+
+bool recvResponse(int fd, cnflow::Detections &boxes, bool &rejected) {
+    uint32_t nboxes;
+    if (!readAll(fd, &nboxes, sizeof(nboxes))) {
+        return false;
+    }
+    rejected = nboxes == RESPONSE_REJECTED;
+    if (rejected) {
+        boxes.clear();
+        return true;
+    }
+    boxes.resize(nboxes);
+    return readAll(fd, boxes.data(), sizeof(cnflow::FaceBox) * nboxes);
+}
+
+CnServer::CnServer(cnflow::CnFlow *flow, int port): flow(flow), port(port) {}
+
+CnServer::~CnServer() {
+    stop();
+}
+
+void CnServer::start() {
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    CHECK_GE(listen_fd, 0) << "socket: " << strerror(errno);
+    int one = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    CHECK_EQ(bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)), 0) << "bind: " << strerror(errno);
+    CHECK_EQ(listen(listen_fd, 128), 0) << "listen: " << strerror(errno);
+
+    LOG(INFO) << "CnServer listening on 127.0.0.1:" << port;
+    running = true;
+    accept_thread = new std::thread(&CnServer::runAccept, this);
+}
+
+void CnServer::stop() {
+    if (!running.exchange(false)) {
+        return;
+    }
+    shutdown(listen_fd, SHUT_RDWR);
+    close(listen_fd);
+    accept_thread->join();
+    delete accept_thread;
+    accept_thread = nullptr;
+
+    std::lock_guard<std::mutex> lock(connections_locker);
+    for (auto &connection : connections) {
+        shutdown(connection->fd, SHUT_RDWR);
+    }
+    reapConnections(true);
+}
+
+void CnServer::reapConnections(bool all) {
+    for (auto it = connections.begin(); it != connections.end();) {
+        if (all || (*it)->done) {
+            (*it)->thread.join();
+            close((*it)->fd);
+            it = connections.erase(it);
+        }
+        else {
+            ++it;
+        }
+    }
+}
+
+void CnServer::runAccept() {
+    while (running) {
+        int fd = accept(listen_fd, nullptr, nullptr);
+        if (fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        std::lock_guard<std::mutex> lock(connections_locker);
+        reapConnections(false);
+        Connection *connection = new Connection;
+        connection->fd = fd;
+        connections.emplace_back(connection);
+        connection->thread = std::thread(&CnServer::runConnection, this, connection);
+    }
+}
+
+/* One request in flight per connection, clients open more connections for concurrency.
+ * The fd stays open until the connection is reaped, so stop() never shuts down a reused fd.
+ */
+void CnServer::runConnection(Connection *connection) {
+    int fd = connection->fd;
+    std::vector<uchar> encoded;
+    while (running) {
+        uint32_t nbytes;
+        if (!readAll(fd, &nbytes, sizeof(nbytes))) {
+            break;
+        }
+        if (nbytes == 0 || nbytes > MAX_REQUEST_BYTES) {
+            LOG(WARNING) << "CnServer: bad request size " << nbytes;
+            break;
+        }
+        encoded.resize(nbytes);
+        if (!readAll(fd, encoded.data(), nbytes)) {
+            break;
+        }
+
+        cnflow::Detections boxes;
+        try {
+            boxes = flow->submit(encoded).get();
+        } catch (const std::exception &) {
+            // Refused by admission control, or the image could not be decoded.
+            if (!writeAll(fd, &RESPONSE_REJECTED, sizeof(RESPONSE_REJECTED))) {
+                break;
+            }
+            continue;
+        }
+
+        uint32_t nboxes = boxes.size();
+        if (!writeAll(fd, &nboxes, sizeof(nboxes)) ||
+            !writeAll(fd, boxes.data(), sizeof(cnflow::FaceBox) * nboxes)) {
+            break;
+        }
+    }
+    shutdown(fd, SHUT_RDWR);
+    connection->done = true;
+}
+
+}  // namespace cnserver
@@ -0,0 +1,318 @@
+#include "cnsink.h"
+
+#include <cerrno>
+#include <cstring>
+
+#include <unistd.h>
+
+#include "glog/logging.h"
+#include "cnmodel.h"
+
+namespace cnsink {
+
+static void appendJsonString(std::string &out, const std::string &s) {
+    out += '"';
+    for (char c : s) {
+        switch (c) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20) {
+                    char hex[8];
+                    snprintf(hex, sizeof(hex), "\\u%04x", c);
+                    out += hex;
+                }
+                else {
+                    out += c;
+                }
+        }
+    }
+    out += '"';
+}
+
+JsonLinesWriter::JsonLinesWriter(const std::string &path, bool compress) {
+    if (compress) {
+        gzfile = gzopen(path.c_str(), "wb1");
+        CHECK(gzfile != nullptr) << "Can not open " << path;
+    }
+    else {
+        file = fopen(path.c_str(), "wb");
+        CHECK(file != nullptr) << "Can not open " << path;
+    }
+}
+
+JsonLinesWriter::~JsonLinesWriter() {
+    flush();
+    if (gzfile) {
+        gzclose(gzfile);
+    }
+    if (file) {
+        fclose(file);
+    }
+}
+
+void JsonLinesWriter::write(const std::vector<SinkRecord> &records) {
+    char number[64];
+    for (auto &record : records) {
+        buffer += "{\"id\":";
+        buffer += std::to_string(record.id);
+        buffer += ",\"image\":";
+        appendJsonString(buffer, record.imagename);
+        buffer += ",\"boxes\":[";
+        for (size_t i = 0; i < record.boxes.size(); ++i) {
+            const cnflow::FaceBox &box = record.boxes[i];
+            snprintf(number, sizeof(number), "%s[%.2f,%.2f,%.2f,%.2f,%.4f]", i > 0 ? "," : "",
+                     box.x1, box.y1, box.x2, box.y2, box.score);
+            buffer += number;
+        }
+        buffer += "]}\n";
+    }
+}
+
+bool JsonLinesWriter::flush() {
+    if (buffer.empty()) {
+        return true;
+    }
+    bool ok;
+    if (gzfile) {
+        int errnum = Z_OK;
+        ok = gzwrite(gzfile, buffer.data(), buffer.size()) == static_cast<int>(buffer.size())
+             && gzflush(gzfile, Z_SYNC_FLUSH) == Z_OK;
+        if (!ok) {
+            LOG(ERROR) << "Can not write results: " << gzerror(gzfile, &errnum);
+        }
+    }
+    else {
+        ok = fwrite(buffer.data(), 1, buffer.size(), file) == buffer.size() && fflush(file) == 0;
+        if (!ok) {
+            LOG(ERROR) << "Can not write results: " << strerror(errno);
+        }
+    }
+    if (ok) {
+        written += buffer.size();
+    }
+    buffer.clear();
+    return ok;
+}
+
+template <typename T>
+static void append(std::vector<uint8_t> &out, const T &value) {
+    const uint8_t *p = reinterpret_cast<const uint8_t *>(&value);
+    out.insert(out.end(), p, p + sizeof(T));
+}
+
+BinaryWriter::BinaryWriter(const std::string &path, bool compress): compress(compress) {
+    file = fopen(path.c_str(), "wb");
+    CHECK(file != nullptr) << "Can not open " << path;
+    index_file = fopen((path + ".idx").c_str(), "wb");
+    CHECK(index_file != nullptr) << "Can not open " << path << ".idx";
+}
+
+BinaryWriter::~BinaryWriter() {
+    flush();
+    fclose(file);
+    fclose(index_file);
+}
+
+void BinaryWriter::write(const std::vector<SinkRecord> &records) {
+    for (auto &record : records) {
+        IndexEntry entry;
+        entry.block_offset = offset;
+        entry.record_offset = raw.size();
+
+        uint16_t name_bytes = std::min<size_t>(record.imagename.size(), UINT16_MAX);
+        uint32_t nboxes = record.boxes.size();
+        append(raw, record.id);
+        append(raw, name_bytes);
+        raw.insert(raw.end(), record.imagename.begin(), record.imagename.begin() + name_bytes);
+        append(raw, nboxes);
+        const uint8_t *boxes = reinterpret_cast<const uint8_t *>(record.boxes.data());
+        raw.insert(raw.end(), boxes, boxes + sizeof(cnflow::FaceBox) * nboxes);
+
+        entry.record_bytes = raw.size() - entry.record_offset;
+        entries.push_back(entry);
+    }
+}
+
+bool BinaryWriter::flush() {
+    if (raw.empty()) {
+        return true;
+    }
+
+    uint32_t header[3] = {static_cast<uint32_t>(raw.size()), static_cast<uint32_t>(raw.size()), 0};
+    const uint8_t *data = raw.data();
+    if (compress) {
+        uLongf stored_bytes = compressBound(raw.size());
+        stored.resize(stored_bytes);
+        if (compress2(stored.data(), &stored_bytes, raw.data(), raw.size(), 1) == Z_OK) {
+            header[1] = stored_bytes;
+            header[2] = 1;
+            data = stored.data();
+        }
+    }
+    bool ok = fwrite(header, sizeof(header), 1, file) == 1
+              && fwrite(data, 1, header[1], file) == header[1] && fflush(file) == 0;
+    if (!ok) {
+        LOG(ERROR) << "Can not write results: " << strerror(errno);
+    }
+    else {
+        ok = fwrite(entries.data(), sizeof(IndexEntry), entries.size(), index_file) == entries.size()
+             && fflush(index_file) == 0;
+        if (!ok) {
+            LOG(ERROR) << "Can not write the result index: " << strerror(errno);
+        }
+    }
+    if (ok) {
+        offset += sizeof(header) + header[1];
+        index_bytes += sizeof(IndexEntry) * entries.size();
+    }
+    else {
+        // Cut both files back to the last whole block and its entries, so the index never
+        // points into a partial block and stays aligned with the record positions.
+        fseek(file, offset, SEEK_SET);
+        fseek(index_file, index_bytes, SEEK_SET);
+        if (ftruncate(fileno(file), offset) != 0 || ftruncate(fileno(index_file), index_bytes) != 0) {
+            LOG(ERROR) << "Can not truncate the results: " << strerror(errno);
+        }
+    }
+
+    raw.clear();
+    entries.clear();
+    return ok;
+}
+
+bool BinaryWriter::read(const std::string &path, uint64_t index, SinkRecord &record) {
+    bool ret = false;
+    FILE *file = fopen(path.c_str(), "rb");
+    FILE *index_file = fopen((path + ".idx").c_str(), "rb");
+    IndexEntry entry;
+    uint32_t header[3];
+    if (file && index_file &&
+        fseek(index_file, index * sizeof(IndexEntry), SEEK_SET) == 0 &&
+        fread(&entry, sizeof(entry), 1, index_file) == 1 &&
+        fseek(file, entry.block_offset, SEEK_SET) == 0 &&
+        fread(header, sizeof(header), 1, file) == 1) {
+        std::vector<uint8_t> stored(header[1]);
+        std::vector<uint8_t> raw(header[0]);
+        if (fread(stored.data(), 1, stored.size(), file) == stored.size()) {
+            uLongf raw_bytes = raw.size();
+            if (header[2]) {
+                ret = uncompress(raw.data(), &raw_bytes, stored.data(), stored.size()) == Z_OK;
+                raw.resize(raw_bytes);
+            }
+            else {
+                raw.swap(stored);
+                ret = true;
+            }
+        }
+        // The entry comes from another file than the block, check it before reading through it.
+        const size_t fixed_bytes = sizeof(record.id) + sizeof(uint16_t) + sizeof(uint32_t);
+        ret = ret && entry.record_bytes >= fixed_bytes && entry.record_offset <= raw.size()
+              && entry.record_bytes <= raw.size() - entry.record_offset;
+        if (ret) {
+            const uint8_t *p = raw.data() + entry.record_offset;
+            uint16_t name_bytes;
+            uint32_t nboxes;
+            memcpy(&record.id, p, sizeof(record.id));
+            p += sizeof(record.id);
+            memcpy(&name_bytes, p, sizeof(name_bytes));
+            p += sizeof(name_bytes);
+            ret = fixed_bytes + name_bytes <= entry.record_bytes;
+            if (ret) {
+                record.imagename.assign(reinterpret_cast<const char *>(p), name_bytes);
+                p += name_bytes;
+                memcpy(&nboxes, p, sizeof(nboxes));
+                p += sizeof(nboxes);
+                ret = nboxes <= (entry.record_bytes - fixed_bytes - name_bytes) / sizeof(cnflow::FaceBox);
+            }
+            if (ret) {
+                record.boxes.resize(nboxes);
+                memcpy(record.boxes.data(), p, sizeof(cnflow::FaceBox) * nboxes);
+            }
+        }
+    }
+    if (file) {
+        fclose(file);
+    }
+    if (index_file) {
+        fclose(index_file);
+    }
+    return ret;
+}
+
+ResultSink::ResultSink(ResultWriter *writer, int capacity, int batch_records, int flush_ms, bool drop_when_full):
+    writer(writer), records(capacity), batch_records(batch_records), flush_ms(flush_ms),
+    drop_when_full(drop_when_full) {
+    thread = new std::thread(&ResultSink::run, this);
+}
+
+ResultSink::~ResultSink() {
+    close();
+}
+
+void ResultSink::put(SinkRecord &&record) {
+    if (drop_when_full) {
+        if (records.try_push(record) != 0) {
+            ++dropped;
+            return;
+        }
+    }
+    else {
+        records.push(record);
+    }
+    ++queued;
+}
+
+void ResultSink::run() {
+    uint64_t last_flush = cnmodel::time();
+    uint64_t unflushed = 0;
+    while (true) {
+        bool stopping = !running;
+        std::vector<SinkRecord> batch = records.try_pop_n(batch_records);
+        if (!batch.empty()) {
+            writer->write(batch);
+            unflushed += batch.size();
+        }
+
+        uint64_t now = cnmodel::time();
+        if (unflushed > 0 && (stopping || now - last_flush >= flush_ms * 1000ull)) {
+            // Records only count as written once they are in the file.
+            if (writer->flush()) {
+                written += unflushed;
+            }
+            else {
+                failed += unflushed;
+            }
+            ++flushes;
+            unflushed = 0;
+            last_flush = now;
+        }
+        if (batch.empty()) {
+            if (stopping) {
+                break;
+            }
+            USLEEP(1000);
+        }
+    }
+}
+
+void ResultSink::close() {
+    if (!running.exchange(false)) {
+        return;
+    }
+    thread->join();
+    delete thread;
+    thread = nullptr;
+    show();
+}
+
+void ResultSink::show() {
+    LOG(INFO) << "result sink: queued " << queued << " written " << written
+              << " dropped " << dropped << " flushes " << flushes
+              << " failed " << failed << " bytes " << writer->bytes();
+}
+
+}  // namespace cnsink
@@ -0,0 +1,267 @@
+#include "loadgen.h"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <list>
+#include <random>
+#include <sstream>
+#include <thread>
+
+#include "glog/logging.h"
+#include "cnmodel.h"
+#include "tsque.h"
+
+namespace loadgen {
+
+bool parseArrival(const std::string &name, Arrival_t &arrival) {
+    if (name == "constant") {
+        arrival = ARRIVAL_CONSTANT;
+    }
+    else if (name == "poisson") {
+        arrival = ARRIVAL_POISSON;
+    }
+    else if (name == "bursty") {
+        arrival = ARRIVAL_BURSTY;
+    }
+    else if (name == "trace") {
+        arrival = ARRIVAL_TRACE;
+    }
+    else {
+        return false;
+    }
+    return true;
+}
+
+std::vector<uint64_t> arrivals(Arrival_t arrival, double rate, int num_requests, uint64_t seed, int burst_size) {
+    std::vector<uint64_t> offsets;
+    std::mt19937_64 rng(seed);
+    burst_size = std::max(1, burst_size);
+    double t = 0;
+    for (int i = 0; i < num_requests; ++i) {
+        switch (arrival) {
+            case ARRIVAL_POISSON:
+                t += std::exponential_distribution<double>(rate)(rng);
+                break;
+            case ARRIVAL_BURSTY:
+                if (i % burst_size == 0) {
+                    t += std::exponential_distribution<double>(rate / burst_size)(rng);
+                }
+                break;
+            default:
+                t = i / rate;
+                break;
+        }
+        offsets.push_back(static_cast<uint64_t>(t * 1000000.));
+    }
+    return offsets;
+}
+
+std::vector<uint64_t> loadTrace(const std::string &path) {
+    std::vector<uint64_t> trace;
+    std::ifstream file(path);
+    if (!file) {
+        LOG(ERROR) << "Can not open trace " << path;
+        return trace;
+    }
+    std::vector<double> stamps;
+    std::string line;
+    while (std::getline(file, line)) {
+        if (!line.empty() && line[0] != '#') {
+            stamps.push_back(atof(line.c_str()));
+        }
+    }
+    std::sort(stamps.begin(), stamps.end());
+    for (double stamp : stamps) {
+        trace.push_back(static_cast<uint64_t>((stamp - stamps[0]) * 1000000.));
+    }
+    return trace;
+}
+
+std::vector<uint64_t> scaleTrace(const std::vector<uint64_t> &trace, double rate, int num_requests) {
+    std::vector<uint64_t> offsets;
+    if (trace.empty()) {
+        return offsets;
+    }
+    // One repetition lasts the trace plus one mean gap, so the rate holds across repetitions.
+    double n = trace.size();
+    double period = trace.size() > 1 ? trace.back() * n / (n - 1) : 0.;
+    double target = n / rate * 1000000.;
+    double scale = period > 0 ? target / period : 1.;
+    if (period <= 0) {
+        period = target;
+    }
+    for (int i = 0; i < num_requests; ++i) {
+        uint64_t round = i / trace.size();
+        double t = (round * period + trace[i % trace.size()]) * scale;
+        offsets.push_back(static_cast<uint64_t>(t));
+    }
+    return offsets;
+}
+
+std::vector<cv::Mat> syntheticImages(int count, int height, int width, uint64_t seed) {
+    std::vector<cv::Mat> images;
+    cv::RNG rng(seed);
+    for (int i = 0; i < count; ++i) {
+        cv::Mat image(height, width, CV_8UC3);
+        rng.fill(image, cv::RNG::UNIFORM, cv::Scalar::all(0), cv::Scalar::all(256));
+        images.push_back(image);
+    }
+    return images;
+}
+
+LoadGenerator::LoadGenerator(cnflow::CnFlow *flow, const std::vector<std::vector<uchar>> &encoded,
+                             const std::vector<cv::Mat> &decoded):
+    flow(flow), encoded(encoded), decoded(decoded) {}
+
+std::future<cnflow::Detections> LoadGenerator::submit(uint64_t index) {
+    if (!decoded.empty()) {
+        return flow->submit(decoded[index % decoded.size()]);
+    }
+    return flow->submit(encoded[index % encoded.size()]);
+}
+
+LoadPoint LoadGenerator::run(const std::vector<uint64_t> &schedule) {
+    typedef struct Pending {
+        uint64_t arrival;
+        std::shared_future<cnflow::Detections> future;
+    } Pending;
+
+    LoadPoint point;
+    tsque::TsQueue<Pending> sent;
+    std::atomic<bool> sending{true};
+    std::vector<uint64_t> latencies;
+    uint64_t last_completion = 0;
+    uint64_t start = cnmodel::time();
+
+    std::thread collector([&]() {
+        std::list<Pending> pending;
+        while (sending || !sent.empty() || !pending.empty()) {
+            for (auto &p : sent.try_pop_n(1024)) {
+                pending.push_back(p);
+            }
+            bool worked = false;
+            for (auto it = pending.begin(); it != pending.end();) {
+                if (it->future.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+                    ++it;
+                    continue;
+                }
+                uint64_t now = cnmodel::time() - start;
+                try {
+                    it->future.get();
+                    latencies.push_back(now > it->arrival ? now - it->arrival : 0);
+                    last_completion = now;
+                }
+                catch (const std::exception &) {
+                    // Refused by admission control or failed in the flow: no latency sample.
+                    ++point.rejected;
+                }
+                it = pending.erase(it);
+                worked = true;
+            }
+            if (!worked) {
+                USLEEP(20);
+            }
+        }
+    });
+
+    double lag = 0;
+    for (size_t i = 0; i < schedule.size(); ++i) {
+        uint64_t now = cnmodel::time() - start;
+        // Sleep most of the gap, spin the rest.
+        if (schedule[i] > now + 200) {
+            USLEEP(schedule[i] - now - 100);
+        }
+        while ((now = cnmodel::time() - start) < schedule[i]) {}
+        lag += now - schedule[i];
+
+        Pending p;
+        p.arrival = schedule[i];
+        p.future = submit(i).share();
+        sent.push(p);
+    }
+    sending = false;
+    collector.join();
+
+    point.sent = schedule.size();
+    point.completed = latencies.size();
+    point.send_lag_us = schedule.empty() ? 0. : lag / schedule.size();
+    if (schedule.size() > 1 && schedule.back() > 0) {
+        point.offered_qps = 1000000. * (schedule.size() - 1) / schedule.back();
+    }
+    point.achieved_qps = last_completion > 0 ? 1000000. * point.completed / last_completion : 0.;
+
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&](double p) -> uint64_t {
+        if (latencies.empty()) {
+            return 0;
+        }
+        return latencies[std::min(latencies.size() - 1, static_cast<size_t>(p * latencies.size()))];
+    };
+    double sum = 0;
+    for (auto latency : latencies) {
+        sum += latency;
+    }
+    point.latency_mean_us = latencies.empty() ? 0. : sum / latencies.size();
+    point.latency_p50_us = percentile(0.5);
+    point.latency_p90_us = percentile(0.9);
+    point.latency_p99_us = percentile(0.99);
+    point.latency_p999_us = percentile(0.999);
+    point.latency_max_us = latencies.empty() ? 0 : latencies.back();
+    return point;
+}
+
+std::vector<LoadPoint> LoadGenerator::sweep(Arrival_t arrival, std::vector<double> rates, double duration_sec,
+                                            const std::vector<uint64_t> &trace, double saturation) {
+    std::vector<LoadPoint> points;
+    std::sort(rates.begin(), rates.end());
+    // A blocking submit would hold the sender back at saturation and turn the run closed-loop,
+    // beyond the in-flight budget requests are rejected instead and counted as such.
+    cnflow::AdmissionPolicy_t policy = flow->admission_policy;
+    flow->admission_policy = cnflow::ADMIT_REJECT;
+    for (double rate : rates) {
+        int num_requests = std::max(1, static_cast<int>(rate * duration_sec));
+        std::vector<uint64_t> schedule = arrival == ARRIVAL_TRACE ? scaleTrace(trace, rate, num_requests)
+                                                                  : arrivals(arrival, rate, num_requests, seed, burst_size);
+        LoadPoint point = run(schedule);
+        point.offered_qps = rate;
+        points.push_back(point);
+
+        LOG(INFO) << "offered " << rate << " qps: achieved " << point.achieved_qps
+                  << " p50 " << point.latency_p50_us << " us"
+                  << " p99 " << point.latency_p99_us << " us"
+                  << " rejected " << point.rejected
+                  << " send lag " << point.send_lag_us << " us";
+        if (point.achieved_qps < rate * saturation) {
+            LOG(INFO) << "saturated at " << rate << " qps, sweep stops";
+            break;
+        }
+    }
+    flow->admission_policy = policy;
+    return points;
+}
+
+std::string curveJson(const std::vector<LoadPoint> &points) {
+    std::ostringstream json;
+    json << "[";
+    for (size_t i = 0; i < points.size(); ++i) {
+        const LoadPoint &p = points[i];
+        json << (i > 0 ? ",\n    " : "\n    ")
+             << "{\"offered_qps\":" << p.offered_qps
+             << ", \"achieved_qps\":" << p.achieved_qps
+             << ", \"sent\":" << p.sent
+             << ", \"completed\":" << p.completed
+             << ", \"rejected\":" << p.rejected
+             << ", \"send_lag_us\":" << p.send_lag_us
+             << ", \"latency_mean_us\":" << p.latency_mean_us
+             << ", \"latency_p50_us\":" << p.latency_p50_us
+             << ", \"latency_p90_us\":" << p.latency_p90_us
+             << ", \"latency_p99_us\":" << p.latency_p99_us
+             << ", \"latency_p999_us\":" << p.latency_p999_us
+             << ", \"latency_max_us\":" << p.latency_max_us << "}";
+    }
+    json << (points.empty() ? "]" : "\n  ]");
+    return json.str();
+}
+
+}  // namespace loadgen
@@ -0,0 +1,122 @@
+#include "metrics.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+
+#include "glog/logging.h"
+#include "cnserver.h"
+
+namespace metrics {
+
+MetricsServer::MetricsServer(int port, const std::function<std::string()> &provider):
+    port(port), provider(provider) {}
+
+MetricsServer::~MetricsServer() {
+    stop();
+}
+
+void MetricsServer::start() {
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    CHECK_GE(listen_fd, 0) << "socket: " << strerror(errno);
+    int one = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    CHECK_EQ(bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)), 0) << "bind: " << strerror(errno);
+    CHECK_EQ(listen(listen_fd, 16), 0) << "listen: " << strerror(errno);
+
+    LOG(INFO) << "metrics on http://127.0.0.1:" << port << "/metrics";
+    running = true;
+    accept_thread = new std::thread(&MetricsServer::runAccept, this);
+}
+
+void MetricsServer::stop() {
+    if (!running.exchange(false)) {
+        return;
+    }
+    shutdown(listen_fd, SHUT_RDWR);
+    close(listen_fd);
+    accept_thread->join();
+    delete accept_thread;
+    accept_thread = nullptr;
+}
+
+void MetricsServer::runAccept() {
+    while (running) {
+        int fd = accept(listen_fd, nullptr, nullptr);
+        if (fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        // A client that never sends its request must not stall the next scrape.
+        struct timeval timeout = {1, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        serve(fd);
+        close(fd);
+    }
+}
+
+void MetricsServer::serve(int fd) {
+    std::string request;
+    char buf[1024];
+    while (request.find("\r\n\r\n") == std::string::npos && request.size() < 8192) {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        request.append(buf, n);
+    }
+
+    std::string status = "404 Not Found";
+    std::string type = "text/plain";
+    std::string body = "not found\n";
+    if (request.compare(0, 13, "GET /metrics ") == 0 || request.compare(0, 14, "GET /metrics\r\n") == 0) {
+        status = "200 OK";
+        type = "text/plain; version=0.0.4";
+        body = provider();
+    }
+    std::string response = "HTTP/1.0 " + status + "\r\n"
+                           "Content-Type: " + type + "\r\n"
+                           "Content-Length: " + std::to_string(body.size()) + "\r\n"
+                           "Connection: close\r\n\r\n" + body;
+    cnserver::writeAll(fd, response.data(), response.size());
+}
+
+std::string httpGet(int port, const std::string &path) {
+    int fd = cnserver::connectLoopback(port);
+    if (fd < 0) {
+        return "";
+    }
+    std::string request = "GET " + path + " HTTP/1.0\r\n\r\n";
+    std::string response;
+    if (cnserver::writeAll(fd, request.data(), request.size())) {
+        char buf[4096];
+        ssize_t n;
+        while ((n = read(fd, buf, sizeof(buf))) > 0) {
+            response.append(buf, n);
+        }
+    }
+    close(fd);
+    size_t body = response.find("\r\n\r\n");
+    if (response.compare(0, 12, "HTTP/1.0 200") != 0 || body == std::string::npos) {
+        return "";
+    }
+    return response.substr(body + 4);
+}
+
+}  // namespace metrics
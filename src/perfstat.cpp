@@ -0,0 +1,158 @@
+#include "perfstat.h"
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <sstream>
+
+#include "glog/logging.h"
+
+namespace perfstat {
+
+static std::atomic<bool> counters_available{true};
+
+static uint64_t now() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/* The hardware counters of one thread in one perf group, read together with one read(). */
+class ThreadCounters {
+public:
+    ThreadCounters() {
+        if (!counters_available) {
+            return;
+        }
+        const uint64_t configs[] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+                                    PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+        for (int i = 0; i < NUM_HARDWARE; ++i) {
+            struct perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = configs[i];
+            attr.read_format = PERF_FORMAT_GROUP;
+            attr.disabled = i == 0;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            fds[i] = syscall(__NR_perf_event_open, &attr, 0, -1, i == 0 ? -1 : fds[0], 0);
+            if (fds[i] < 0) {
+                if (counters_available.exchange(false)) {
+                    LOG(WARNING) << "Can not open hardware counters (" << strerror(errno)
+                                 << "), check /proc/sys/kernel/perf_event_paranoid";
+                }
+                close();
+                return;
+            }
+        }
+        ioctl(fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+        opened = true;
+    }
+
+    ~ThreadCounters() {
+        close();
+    }
+
+    /* Hardware counters from the group, context switches from the rusage of the thread. */
+    void read(uint64_t *values) {
+        uint64_t group[1 + NUM_HARDWARE] = {0};
+        if (opened && ::read(fds[0], group, sizeof(group)) == static_cast<ssize_t>(sizeof(group))) {
+            for (int i = 0; i < NUM_HARDWARE; ++i) {
+                values[i] = group[1 + i];
+            }
+        }
+        else {
+            memset(values, 0, NUM_HARDWARE * sizeof(uint64_t));
+        }
+        struct rusage usage;
+        getrusage(RUSAGE_THREAD, &usage);
+        values[COUNTER_CONTEXT_SWITCHES] = usage.ru_nvcsw + usage.ru_nivcsw;
+    }
+
+private:
+    static const int NUM_HARDWARE = COUNTER_CONTEXT_SWITCHES;
+
+    void close() {
+        for (int i = 0; i < NUM_HARDWARE; ++i) {
+            if (fds[i] >= 0) {
+                ::close(fds[i]);
+                fds[i] = -1;
+            }
+        }
+        opened = false;
+    }
+
+    int fds[NUM_HARDWARE] = {-1, -1, -1, -1};
+    bool opened = false;
+};
+
+static ThreadCounters &threadCounters() {
+    static thread_local ThreadCounters counters;
+    return counters;
+}
+
+bool available() {
+    return counters_available;
+}
+
+Scope::Scope(Stage *stage): stage(stage) {
+    if (stage) {
+        threadCounters().read(start);
+        start_time = now();
+    }
+}
+
+Scope::~Scope() {
+    stop();
+}
+
+void Scope::stop() {
+    if (!stage) {
+        return;
+    }
+    uint64_t end[NUM_COUNTERS];
+    threadCounters().read(end);
+    for (int i = 0; i < NUM_COUNTERS; ++i) {
+        stage->counts[i] += end[i] - start[i];
+    }
+    stage->time_us += now() - start_time;
+    stage->images += images;
+    ++stage->calls;
+    stage = nullptr;
+}
+
+void Stage::reset() {
+    for (auto &count : counts) {
+        count = 0;
+    }
+    calls = 0;
+    images = 0;
+    time_us = 0;
+}
+
+std::string Stage::report() {
+    std::ostringstream line;
+    line << name << ": calls " << calls << " images " << images << " time " << time_us << " us";
+    double cycles = counts[COUNTER_CYCLES];
+    if (cycles == 0) {
+        line << " (no hardware counters)";
+    }
+    else {
+        line << " IPC " << counts[COUNTER_INSTRUCTIONS] / cycles;
+    }
+    double per = images > 0 ? 1. / images : 0.;
+    line << " per image: cycles " << cycles * per
+         << " instructions " << counts[COUNTER_INSTRUCTIONS] * per
+         << " LLC misses " << counts[COUNTER_LLC_MISSES] * per
+         << " branch misses " << counts[COUNTER_BRANCH_MISSES] * per
+         << " context switches " << counts[COUNTER_CONTEXT_SWITCHES] * per;
+    return line.str();
+}
+
+}  // namespace perfstat
@@ -0,0 +1,229 @@
+#include "shmring.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <new>
+
+#include "glog/logging.h"
+#include "tsque.h"
+
+namespace shmring {
+
+static const uint32_t RING_MAGIC = 0x676e6972;    // "ring"
+static const uint32_t RING_VERSION = 1;
+
+static size_t align64(size_t bytes) {
+    return (bytes + 63) & ~static_cast<size_t>(63);
+}
+
+static size_t ringBytes(uint32_t num_slots, uint32_t slot_bytes) {
+    return align64(sizeof(RingHeader)) + num_slots * align64(sizeof(SlotHeader) + slot_bytes);
+}
+
+ShmRing::ShmRing(const std::string &name, void *base, size_t bytes, bool owner):
+    ring_name(name), base(base), bytes(bytes), owner(owner) {
+    header = static_cast<RingHeader *>(base);
+    stride = align64(sizeof(SlotHeader) + header->slot_bytes);
+}
+
+ShmRing::~ShmRing() {
+    munmap(base, bytes);
+    if (owner) {
+        shm_unlink(ring_name.c_str());
+    }
+}
+
+ShmRing *ShmRing::create(const std::string &name, uint32_t num_slots, uint32_t slot_bytes) {
+    shm_unlink(name.c_str());
+    int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0) {
+        LOG(ERROR) << "Can not create shared memory " << name << ": " << strerror(errno);
+        return nullptr;
+    }
+    size_t bytes = ringBytes(num_slots, slot_bytes);
+    if (ftruncate(fd, bytes) != 0) {
+        LOG(ERROR) << "Can not size shared memory " << name << " to " << bytes << ": " << strerror(errno);
+        close(fd);
+        shm_unlink(name.c_str());
+        return nullptr;
+    }
+    void *base = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        LOG(ERROR) << "Can not map shared memory " << name << ": " << strerror(errno);
+        shm_unlink(name.c_str());
+        return nullptr;
+    }
+
+    RingHeader *header = new (base) RingHeader;
+    header->version = RING_VERSION;
+    header->num_slots = num_slots;
+    header->slot_bytes = slot_bytes;
+    header->head = 0;
+    header->tail = 0;
+    ShmRing *ring = new ShmRing(name, base, bytes, true);
+    for (uint32_t i = 0; i < num_slots; ++i) {
+        SlotHeader *slot = new (ring->slot(i)) SlotHeader;
+        slot->sequence = i;
+    }
+    // Producers check the magic last, it is written once the ring is usable.
+    std::atomic_thread_fence(std::memory_order_release);
+    header->magic = RING_MAGIC;
+    return ring;
+}
+
+ShmRing *ShmRing::open(const std::string &name) {
+    int fd = shm_open(name.c_str(), O_RDWR, 0600);
+    if (fd < 0) {
+        LOG(ERROR) << "Can not open shared memory " << name << ": " << strerror(errno);
+        return nullptr;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(RingHeader)) {
+        LOG(ERROR) << "Shared memory " << name << " is not a ring";
+        close(fd);
+        return nullptr;
+    }
+    size_t bytes = st.st_size;
+    void *base = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        LOG(ERROR) << "Can not map shared memory " << name << ": " << strerror(errno);
+        return nullptr;
+    }
+
+    RingHeader *header = static_cast<RingHeader *>(base);
+    if (header->magic != RING_MAGIC || header->version != RING_VERSION ||
+        ringBytes(header->num_slots, header->slot_bytes) != bytes) {
+        LOG(ERROR) << "Shared memory " << name << " is not a ring of version " << RING_VERSION;
+        munmap(base, bytes);
+        return nullptr;
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return new ShmRing(name, base, bytes, false);
+}
+
+SlotHeader *ShmRing::slot(uint64_t position) {
+    char *slots = static_cast<char *>(base) + align64(sizeof(RingHeader));
+    return reinterpret_cast<SlotHeader *>(slots + (position % header->num_slots) * stride);
+}
+
+SlotHeader *ShmRing::claim(bool blocking) {
+    uint64_t pos = header->head.load(std::memory_order_relaxed);
+    while (true) {
+        SlotHeader *s = slot(pos);
+        int64_t diff = static_cast<int64_t>(s->sequence.load(std::memory_order_acquire) - pos);
+        if (diff == 0) {
+            if (header->head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                s->position = pos;
+                return s;
+            }
+        }
+        else if (diff < 0) {
+            // The slot of the previous lap is not released yet: full.
+            if (!blocking) {
+                return nullptr;
+            }
+            USLEEP(20);
+            pos = header->head.load(std::memory_order_relaxed);
+        }
+        else {
+            pos = header->head.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+void ShmRing::publish(SlotHeader *slot) {
+    slot->sequence.store(slot->position + 1, std::memory_order_release);
+}
+
+SlotHeader *ShmRing::acquire(bool blocking, uint64_t &position) {
+    uint64_t pos = header->tail.load(std::memory_order_relaxed);
+    while (true) {
+        SlotHeader *s = slot(pos);
+        int64_t diff = static_cast<int64_t>(s->sequence.load(std::memory_order_acquire) - (pos + 1));
+        if (diff == 0) {
+            if (header->tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                position = pos;
+                return s;
+            }
+        }
+        else if (diff < 0) {
+            // Not published yet: empty.
+            if (!blocking) {
+                return nullptr;
+            }
+            USLEEP(20);
+            pos = header->tail.load(std::memory_order_relaxed);
+        }
+        else {
+            pos = header->tail.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+void ShmRing::release(SlotHeader *slot, uint64_t position) {
+    CHECK(slot == this->slot(position)) << ring_name << ": released slot is not the one of position " << position;
+    slot->sequence.store(position + header->num_slots, std::memory_order_release);
+}
+
+static bool put(ShmRing *ring, uint64_t tag, uint32_t format, uint32_t rows, uint32_t cols,
+                const void *data, size_t nbytes, bool blocking) {
+    if (nbytes > ring->slotBytes()) {
+        LOG(ERROR) << nbytes << " bytes do not fit a slot of " << ring->name() << " (" << ring->slotBytes() << ")";
+        return false;
+    }
+    SlotHeader *slot = ring->claim(blocking);
+    if (!slot) {
+        return false;
+    }
+    slot->tag = tag;
+    slot->format = format;
+    slot->rows = rows;
+    slot->cols = cols;
+    slot->bytes = nbytes;
+    memcpy(ring->payload(slot), data, nbytes);
+    ring->publish(slot);
+    return true;
+}
+
+bool putFrame(ShmRing *ring, uint64_t tag, const cv::Mat &bgr, bool blocking) {
+    cv::Mat frame = bgr.isContinuous() ? bgr : bgr.clone();
+    return put(ring, tag, SLOT_BGR, frame.rows, frame.cols, frame.data, frame.total() * frame.elemSize(), blocking);
+}
+
+bool putYuv(ShmRing *ring, uint64_t tag, const cv::Mat &yuv, SlotFormat_t format, bool blocking) {
+    cv::Mat frame = yuv.isContinuous() ? yuv : yuv.clone();
+    return put(ring, tag, format, frame.rows * 2 / 3, frame.cols, frame.data, frame.total(), blocking);
+}
+
+bool putEncoded(ShmRing *ring, uint64_t tag, const std::vector<uchar> &encoded, bool blocking) {
+    return put(ring, tag, SLOT_ENCODED, 0, 0, encoded.data(), encoded.size(), blocking);
+}
+
+bool putResponse(ShmRing *ring, uint64_t tag, const cnflow::Detections &boxes, bool rejected) {
+    size_t nboxes = std::min(boxes.size(), ring->slotBytes() / sizeof(cnflow::FaceBox));
+    return put(ring, tag, rejected ? SLOT_REJECTED : SLOT_DETECTIONS, 0, 0,
+               boxes.data(), nboxes * sizeof(cnflow::FaceBox), false);
+}
+
+bool getResponse(ShmRing *ring, uint64_t &tag, cnflow::Detections &boxes, bool &rejected, bool blocking) {
+    uint64_t position;
+    SlotHeader *slot = ring->acquire(blocking, position);
+    if (!slot) {
+        return false;
+    }
+    tag = slot->tag;
+    rejected = slot->format == SLOT_REJECTED;
+    const cnflow::FaceBox *first = reinterpret_cast<const cnflow::FaceBox *>(ring->payload(slot));
+    boxes.assign(first, first + slot->bytes / sizeof(cnflow::FaceBox));
+    ring->release(slot, position);
+    return true;
+}
+
+}  // namespace shmring
@@ -0,0 +1,183 @@
+#include "threadpool.h"
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#include "glog/logging.h"
+#include "tsque.h"
+
+namespace threadpool {
+
+std::vector<int> allowedCpus(int numa_node) {
+    std::vector<int> cpus;
+    if (numa_node >= 0) {
+        std::ifstream file("/sys/devices/system/node/node" + std::to_string(numa_node) + "/cpulist");
+        std::string list;
+        if (std::getline(file, list)) {
+            std::stringstream ss(list);
+            std::string range;
+            while (std::getline(ss, range, ',')) {
+                size_t dash = range.find('-');
+                int first = std::stoi(range.substr(0, dash));
+                int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+                for (int cpu = first; cpu <= last; ++cpu) {
+                    cpus.push_back(cpu);
+                }
+            }
+        }
+        else {
+            LOG(WARNING) << "numa node " << numa_node << " not found, use all cpus";
+        }
+    }
+    if (cpus.empty()) {
+        int n = std::thread::hardware_concurrency();
+        for (int cpu = 0; cpu < (n > 0 ? n : 1); ++cpu) {
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+ThreadPool::ThreadPool(int num_threads, bool pin_cores, int numa_node,
+                       const std::function<void()> &init): init(init) {
+    std::vector<int> cpus = allowedCpus(numa_node);
+    if (num_threads <= 0) {
+        num_threads = cpus.size();
+    }
+    bool pin = pin_cores || numa_node >= 0;
+
+    LOG(INFO) << "thread pool: " << num_threads << " workers" << (pin ? ", pinned" : "");
+    for (int i = 0; i < num_threads; ++i) {
+        workers.push_back(new Worker);
+    }
+    for (int i = 0; i < num_threads; ++i) {
+        int cpu = pin ? cpus[i % cpus.size()] : -1;
+        workers[i]->thread = new std::thread(&ThreadPool::run, this, i, cpu);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    stop();
+    for (auto worker : workers) {
+        delete worker;
+    }
+}
+
+void ThreadPool::stop() {
+    if (!running.exchange(false)) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(idle_locker);
+        idle_cond.notify_all();
+    }
+    for (auto worker : workers) {
+        worker->thread->join();
+        delete worker->thread;
+        worker->thread = nullptr;
+    }
+}
+
+void ThreadPool::addRecurring(const Task &task) {
+    int home = next++ % workers.size();
+    queue(Entry{task, home});
+}
+
+/* Queue on the home deque of the task and wake a sleeping worker. queued is raised before
+ * sleeping is read, and a sleeper raises sleeping before it reads queued, so one of the two
+ * always sees the other.
+ */
+void ThreadPool::queue(Entry entry) {
+    Worker *home = workers[entry.home];
+    {
+        std::lock_guard<std::mutex> lock(home->locker);
+        home->tasks.push_back(std::move(entry));
+    }
+    ++queued;
+    if (sleeping > 0) {
+        std::lock_guard<std::mutex> lock(idle_locker);
+        idle_cond.notify_one();
+    }
+}
+
+/* Pop from the own head, otherwise steal from the head of a victim: the head is the task that
+ * waited longest, the tail the one that just ran.
+ */
+bool ThreadPool::take(int index, Entry &entry) {
+    {
+        Worker *self = workers[index];
+        std::lock_guard<std::mutex> lock(self->locker);
+        if (!self->tasks.empty()) {
+            entry = std::move(self->tasks.front());
+            self->tasks.pop_front();
+            --queued;
+            return true;
+        }
+    }
+    for (size_t i = 1; i < workers.size(); ++i) {
+        Worker *victim = workers[(index + i) % workers.size()];
+        std::lock_guard<std::mutex> lock(victim->locker);
+        if (!victim->tasks.empty()) {
+            entry = std::move(victim->tasks.front());
+            victim->tasks.pop_front();
+            --queued;
+            ++stolen;
+            return true;
+        }
+    }
+    return false;
+}
+
+void ThreadPool::run(int index, int cpu) {
+    if (cpu >= 0) {
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        CPU_SET(cpu, &cpuset);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset) != 0) {
+            LOG(WARNING) << "can not pin worker " << index << " to cpu " << cpu;
+        }
+    }
+
+    if (init) {
+        init();
+    }
+
+    int idle = 0;
+    while (running) {
+        Entry entry;
+        if (!take(index, entry)) {
+            // Every task is running on another worker, sleep until one is queued again.
+            std::unique_lock<std::mutex> lock(idle_locker);
+            ++sleeping;
+            idle_cond.wait(lock, [this]() { return !running || queued > 0; });
+            --sleeping;
+            continue;
+        }
+
+        bool worked = entry.task();
+        ++executed;
+
+        // Requeue at the tail of its home deque, behind the tasks waiting there and away from
+        // the head that owner and thieves take from.
+        queue(std::move(entry));
+
+        // Back off once every task of this worker came back empty handed.
+        size_t pending;
+        {
+            std::lock_guard<std::mutex> lock(workers[index]->locker);
+            pending = workers[index]->tasks.size();
+        }
+        idle = worked ? 0 : idle + 1;
+        if (idle >= static_cast<int>(std::max<size_t>(pending, 1))) {
+            idle = 0;
+            USLEEP(100);
+        }
+    }
+}
+
+}  // namespace threadpool
@@ -0,0 +1,92 @@
+#include "cnserver.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/* Closed-loop load generator: every connection sends its next request as soon as
+ * the previous response arrives, the latency is measured end-to-end.
+ */
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        LOG(ERROR) << "Usage: ./test_client image_path [port] [connections] [requests_per_connection]";
+        exit(-1);
+    }
+    std::string image_path = argv[1];
+    int port = argc > 2 ? atoi(argv[2]) : 9527;
+    int connections = argc > 3 ? atoi(argv[3]) : 16;
+    int requests = argc > 4 ? atoi(argv[4]) : 1000;
+
+    std::ifstream file(image_path, std::ios::binary);
+    if (!file) {
+        LOG(ERROR) << "Can not open " << image_path;
+        exit(-1);
+    }
+    std::vector<uchar> encoded((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+    std::mutex locker;
+    std::vector<uint64_t> latencies;
+    int num_rejected = 0;
+    std::vector<std::thread> threads;
+
+    uint64_t t1 = cnmodel::time();
+    for (int c = 0; c < connections; ++c) {
+        threads.emplace_back([&]() {
+            int fd = cnserver::connectLoopback(port);
+            if (fd < 0) {
+                LOG(ERROR) << "Can not connect to port " << port;
+                return;
+            }
+            std::vector<uint64_t> local;
+            int local_rejected = 0;
+            cnflow::Detections boxes;
+            bool rejected;
+            for (int i = 0; i < requests; ++i) {
+                uint64_t start = cnmodel::time();
+                if (!cnserver::sendRequest(fd, encoded) || !cnserver::recvResponse(fd, boxes, rejected)) {
+                    LOG(ERROR) << "Connection closed by server";
+                    break;
+                }
+                if (rejected) {
+                    ++local_rejected;
+                    continue;
+                }
+                local.push_back(cnmodel::time() - start);
+            }
+            close(fd);
+            std::lock_guard<std::mutex> lock(locker);
+            latencies.insert(latencies.end(), local.begin(), local.end());
+            num_rejected += local_rejected;
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    uint64_t t2 = cnmodel::time();
+
+    if (latencies.empty()) {
+        return -1;
+    }
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&](double p) {
+        return latencies[std::min(latencies.size() - 1, static_cast<size_t>(p * latencies.size()))];
+    };
+    double mean = 0;
+    for (auto latency : latencies) {
+        mean += latency;
+    }
+    mean /= latencies.size();
+
+    printf("requests: %zu rejected: %d\n", latencies.size(), num_rejected);
+    printf("qps: %lf\n", 1000000. * latencies.size() / (t2 - t1));
+    printf("latency mean: %.1lf us p50: %lu us p90: %lu us p99: %lu us max: %lu us\n",
+           mean, percentile(0.5), percentile(0.9), percentile(0.99), latencies.back());
+
+    return 0;
+}
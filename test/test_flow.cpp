@@ -1,54 +1,492 @@
 #include "cnflow.h"
+#include "loadgen.h"
 
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <deque>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <sstream>
 #include <string>
 #include <vector>
 
+#include <sys/resource.h>
+
 #include "cnrt.h"
 
-int main(int argc, char* argv[]) {
-    std::string model_path("/share/projects/mxnet-helper/model_fusion_1.cambricon");
+/* End-to-end benchmark: warmup, then repeats timed runs of num_images requests through
+ * CnFlow::submit with at most concurrency requests in flight. Prints a JSON report and
+ * compares it with a stored baseline: exit 1 on a performance regression, exit 2 when the
+ * detections checksum changed. With load=..., the timed runs are replaced by an open-loop
+ * sweep of offered rates and the report is the latency-throughput curve.
+ *
+ * Options are --key=value on the command line or key=value lines in --config=file:
+ */
+static const char *USAGE =
+    "Usage: ./test_flow --model=path [--config=file] [--key=value ...]\n"
+    "  model, func=fusion_0, device=0, dp=1\n"
+    "  variants=               more models (other input sizes or batches), comma separated\n"
+    "  images=datas/face.jpg   image, a .txt list of images, or synthetic (random 640x480)\n"
+    "  synthetic=640x480       size of the synthetic images, e.g. 3840x2160 for tiling\n"
+    "  num_images=10000, warmup=1000, repeats=5, concurrency=512\n"
+    "  input=encoded           encoded: decode in preprocess, decoded: submit cv::Mat,\n"
+    "                          nv12|i420: submit YUV 4:2:0 frames (not with load=)\n"
+    "  fuse_yuv=1              0: convert YUV to BGR before the resize\n"
+    "  metrics_port=0          > 0: Prometheus metrics on http://127.0.0.1:port/metrics\n"
+    "  tile=0                  1: cut images larger than the model into overlapping tiles\n"
+    "  tile_scale=1, tile_overlap=64, tile_global=1\n"
+    "  warmup_invokes=2        invocations per model replica before the flow starts\n"
+    "  stage_counters=0        1: hardware counters per stage (IPC, misses per image)\n"
+    "  reorder=0               > 0: deliver results in submit order, at most this many held back\n"
+    "  max_inflight=1024, max_inflight_bytes=1073741824\n"
+    "                          budget of images / bytes admitted and not yet postprocessed\n"
+    "  admission=block         block|reject|shed: submit() beyond the budget\n"
+    "  preprocess=32, postprocess=32\n"
+    "  executor_threads=-1     >= 0: work-stealing pool (0: one thread per cpu)\n"
+    "  infer_drivers=0         > 0: asynchronous inference from this many threads\n"
+    "  native_output=0\n"
+    "  output=                 write the detections, *.jsonl[.gz] as JSON lines, otherwise binary\n"
+    "  report=                 write the JSON report to this file too\n"
+    "  baseline=               compare with this report\n"
+    "  tolerance=0.05          allowed relative qps drop / p99 rise\n"
+    "  load=                   constant|poisson|bursty|trace: open-loop sweep of the rates,\n"
+    "                          requests beyond max_inflight are rejected, not waited for\n"
+    "  rates=100,200,400       offered requests/s, duration=10 seconds each\n"
+    "  trace=                  arrival timestamps in seconds, one per line, for load=trace\n"
+    "  burst=16                requests per burst for load=bursty\n";
+
+typedef std::map<std::string, std::string> Config;
+
+static void parseOption(Config &config, const std::string &option) {
+    std::string kv = option.compare(0, 2, "--") == 0 ? option.substr(2) : option;
+    size_t eq = kv.find('=');
+    if (kv.empty() || kv[0] == '#' || eq == std::string::npos) {
+        return;
+    }
+    config[kv.substr(0, eq)] = kv.substr(eq + 1);
+}
+
+static std::string get(Config &config, const std::string &key, const std::string &value) {
+    return config.count(key) ? config[key] : value;
+}
+
+static int getInt(Config &config, const std::string &key, int value) {
+    return config.count(key) ? atoi(config[key].c_str()) : value;
+}
 
-    if (argc != 2) {
-        LOG(ERROR) << "Usage: ./test_flow model_path";
+static double getDouble(Config &config, const std::string &key, double value) {
+    return config.count(key) ? atof(config[key].c_str()) : value;
+}
+
+static std::vector<uchar> readFile(const std::string &path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        LOG(ERROR) << "Can not open " << path;
         exit(-1);
     }
-    model_path = argv[1];
-    
-    const int device = 0;
+    return std::vector<uchar>((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+}
 
-    std::vector<std::string> imagepaths(10000, "datas/face.jpg");
-    bool fake_input = true;
+static long peakRssMb() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss / 1024;
+}
 
-    LOG(INFO) << "data path: datas/face.jpg";
-    LOG(INFO) << "fake input: " << fake_input;
+/* FNV-1a over the boxes quantized to 1/4 pixel and 1/1000 score, in submission order. */
+static uint64_t checksum(uint64_t hash, uint64_t index, const cnflow::Detections &boxes) {
+    auto mix = [&](int64_t value) {
+        for (int i = 0; i < 8; ++i) {
+            hash ^= (value >> (8 * i)) & 0xff;
+            hash *= 1099511628211ull;
+        }
+    };
+    mix(index);
+    mix(boxes.size());
+    for (auto &box : boxes) {
+        mix(llround(box.x1 * 4));
+        mix(llround(box.y1 * 4));
+        mix(llround(box.x2 * 4));
+        mix(llround(box.y2 * 4));
+        mix(llround(box.score * 1000));
+    }
+    return hash;
+}
 
-    // Set to 1 for MLU270
-    const int dp_faceboxes = 1;
+/* The number after "key": in a flat JSON report, or the string when it is quoted. */
+static std::string jsonValue(const std::string &json, const std::string &key) {
+    size_t pos = json.find("\"" + key + "\":");
+    if (pos == std::string::npos) {
+        return "";
+    }
+    pos = json.find_first_not_of(" \t", pos + key.size() + 3);
+    if (pos == std::string::npos) {
+        return "";
+    }
+    if (json[pos] == '"') {
+        return json.substr(pos + 1, json.find('"', pos + 1) - pos - 1);
+    }
+    return json.substr(pos, json.find_first_of(",}\n", pos) - pos);
+}
 
-    // The cycle time for imagepaths. If -1, it will not stop.
-    int epoch = 1;
+typedef struct RunResult {
+    double qps;
+    std::vector<uint64_t> latencies;
+    uint64_t checksum;
+} RunResult;
 
-    LOG(INFO) << "model path: " << model_path;
+static RunResult run(cnflow::CnFlow &flower, const std::vector<std::vector<uchar>> &encoded,
+                     const std::vector<cv::Mat> &decoded, const std::vector<cv::Mat> &yuv,
+                     YuvFormat_t yuv_format, int num_images, int concurrency) {
+    flower.requestLatencyQueue.reset();
+
+    RunResult result;
+    result.checksum = 14695981039346656037ull;
+    std::deque<std::future<cnflow::Detections>> pending;
+    uint64_t done = 0;
+    auto wait_one = [&]() {
+        result.checksum = checksum(result.checksum, done++, pending.front().get());
+        pending.pop_front();
+    };
+
+    uint64_t t1 = cnmodel::time();
+    for (int i = 0; i < num_images; ++i) {
+        if (static_cast<int>(pending.size()) >= concurrency) {
+            wait_one();
+        }
+        if (!yuv.empty()) {
+            pending.push_back(flower.submitYuv(yuv[i % yuv.size()], yuv_format));
+        }
+        else if (!decoded.empty()) {
+            pending.push_back(flower.submit(decoded[i % decoded.size()]));
+        }
+        else {
+            pending.push_back(flower.submit(encoded[i % encoded.size()]));
+        }
+    }
+    while (!pending.empty()) {
+        wait_one();
+    }
+    uint64_t t2 = cnmodel::time();
+
+    result.qps = 1000000. * num_images / (t2 - t1);
+    int samples = flower.requestLatencyQueue.size();
+    for (int i = 0; i < samples; ++i) {
+        result.latencies.push_back(flower.requestLatencyQueue[i]);
+    }
+    if (samples < num_images) {
+        LOG(WARNING) << "only the last " << samples << " latencies are kept, raise stat_window";
+    }
+    return result;
+}
+
+int main(int argc, char* argv[]) {
+    Config config;
+    for (int i = 1; i < argc; ++i) {
+        std::string option = argv[i];
+        if (option.compare(0, 9, "--config=") == 0) {
+            std::ifstream file(option.substr(9));
+            std::string line;
+            while (std::getline(file, line)) {
+                parseOption(config, line);
+            }
+        }
+    }
+    // Command line options win over the config file.
+    for (int i = 1; i < argc; ++i) {
+        parseOption(config, argv[i]);
+    }
+    if (!config.count("model")) {
+        fprintf(stderr, "%s", USAGE);
+        exit(-1);
+    }
+
+    std::string images = get(config, "images", "datas/face.jpg");
+    int num_images = getInt(config, "num_images", 10000);
+    int warmup = getInt(config, "warmup", 1000);
+    int repeats = std::max(1, getInt(config, "repeats", 5));
+    int concurrency = std::max(1, getInt(config, "concurrency", 512));
+    int executor_threads = getInt(config, "executor_threads", -1);
+    int infer_drivers = getInt(config, "infer_drivers", 0);
+    int dp = getInt(config, "dp", 1);
+    double tolerance = getDouble(config, "tolerance", 0.05);
+
+    std::vector<std::string> paths;
+    if (images == "synthetic") {
+        // Leaves encoded empty, the decoded images are submitted.
+    }
+    else if (images.size() > 4 && images.compare(images.size() - 4, 4, ".txt") == 0) {
+        std::ifstream list(images);
+        std::string line;
+        while (std::getline(list, line)) {
+            if (!line.empty()) {
+                paths.push_back(line);
+            }
+        }
+    }
+    else {
+        paths.push_back(images);
+    }
+    std::vector<std::vector<uchar>> encoded;
+    std::vector<cv::Mat> decoded;
+    if (images == "synthetic") {
+        int width = 640, height = 480;
+        sscanf(get(config, "synthetic", "640x480").c_str(), "%dx%d", &width, &height);
+        decoded = loadgen::syntheticImages(16, height, width);
+    }
+    std::string input = get(config, "input", "encoded");
+    bool yuv_input = input == "nv12" || input == "i420";
+    for (auto &path : paths) {
+        encoded.push_back(readFile(path));
+        if (input == "decoded" || yuv_input) {
+            decoded.push_back(cv::imdecode(encoded.back(), cv::IMREAD_COLOR));
+        }
+    }
+    // YUV 4:2:0 frames as a camera or a hardware decoder would hand them over.
+    YuvFormat_t yuv_format = input == "i420" ? YUV_I420 : YUV_NV12;
+    std::vector<cv::Mat> yuv;
+    if (yuv_input) {
+        for (auto &image : decoded) {
+            yuv.push_back(bgr_to_yuv420(image(cv::Rect(0, 0, image.cols & ~1, image.rows & ~1)), yuv_format));
+        }
+    }
 
     cnflow::CnFlow flower;
-    // Set the cambricon offline model path.
-    flower.faceboxes_model_path = model_path;
-    // Set the cambricon offline model func name.
-    flower.faceboxes_func_name = "fusion_0";
-    // Set the device id.
-    flower.device = device;
-    // If true, use the fake image (all 1) for input.
-    flower.fake_input = fake_input;
-    // // The number of parallelism models.
-    // int num_models = batch_size + 1;
-    // // The buffer size for model input and output deviceMemory.
-    // int buffer_size = 2 * num_models - 2;
-
-    flower.putImageList(imagepaths, epoch);
-    flower.addFaceBoxesPreprocessEx(32);
-    flower.addFaceBoxesInfer(dp_faceboxes);
-    flower.addFaceBoxesPostProcess(32);
-    flower.join();
-
-    return 0;
+    flower.faceboxes_model_path = get(config, "model", "");
+    flower.faceboxes_func_name = get(config, "func", "fusion_0");
+    flower.device = getInt(config, "device", 0);
+    flower.native_output = getInt(config, "native_output", 0) != 0;
+    flower.fuse_yuv = getInt(config, "fuse_yuv", 1) != 0;
+    flower.setReorderWindow(getInt(config, "reorder", 0));
+    if (config.count("max_inflight") || config.count("max_inflight_bytes") || config.count("admission")) {
+        std::string admission = get(config, "admission", "block");
+        cnflow::AdmissionPolicy_t policy = admission == "reject" ? cnflow::ADMIT_REJECT
+                                         : admission == "shed" ? cnflow::ADMIT_SHED_OLDEST : cnflow::ADMIT_BLOCK;
+        size_t max_bytes = config.count("max_inflight_bytes") ? std::stoull(config["max_inflight_bytes"])
+                                                               : cnflow::AdmissionControl::DEFAULT_MAX_BYTES;
+        flower.setInflightBudget(getInt(config, "max_inflight", cnflow::AdmissionControl::DEFAULT_MAX_IMAGES),
+                                 max_bytes, policy);
+    }
+    flower.stage_counters = getInt(config, "stage_counters", 0) != 0;
+    flower.warmup_invokes = getInt(config, "warmup_invokes", 2);
+    flower.tiling = getInt(config, "tile", 0) != 0;
+    flower.tile_scale = getDouble(config, "tile_scale", 1.);
+    flower.tile_overlap = getInt(config, "tile_overlap", 64);
+    flower.tile_global = getInt(config, "tile_global", 1) != 0;
+    if (getInt(config, "metrics_port", 0) > 0) {
+        flower.startMetrics(getInt(config, "metrics_port", 0));
+    }
+    flower.stat_window = std::max(flower.stat_window, num_images);
+    flower.requestLatencyQueue.resize(flower.stat_window);
+
+    if (executor_threads >= 0) {
+        flower.useExecutor(executor_threads);
+    }
+    std::string output = get(config, "output", "");
+    if (!output.empty()) {
+        auto ends_with = [&](const std::string &suffix) {
+            return output.size() >= suffix.size() && output.compare(output.size() - suffix.size(), suffix.size(), suffix) == 0;
+        };
+        cnsink::ResultWriter *writer;
+        if (ends_with(".jsonl") || ends_with(".jsonl.gz")) {
+            writer = new cnsink::JsonLinesWriter(output, ends_with(".gz"));
+        }
+        else {
+            writer = new cnsink::BinaryWriter(output, ends_with(".gz"));
+        }
+        flower.sink = new cnsink::ResultSink(writer);
+    }
+    if (config.count("variants")) {
+        flower.addFaceBoxesVariant(flower.faceboxes_model_path, flower.faceboxes_func_name, dp);
+        std::stringstream variants(config["variants"]);
+        std::string path;
+        while (std::getline(variants, path, ',')) {
+            if (!path.empty()) {
+                flower.addFaceBoxesVariant(path, flower.faceboxes_func_name, dp);
+            }
+        }
+    }
+    flower.addFaceBoxesPreprocessEx(getInt(config, "preprocess", 32));
+    if (infer_drivers > 0) {
+        flower.addFaceBoxesInferAsync(dp, infer_drivers);
+    }
+    else {
+        flower.addFaceBoxesInfer(dp);
+    }
+    flower.addFaceBoxesPostProcess(getInt(config, "postprocess", 32));
+
+    LOG(INFO) << "warmup: " << warmup << " images";
+    if (warmup > 0) {
+        run(flower, encoded, decoded, yuv, yuv_format, warmup, concurrency);
+    }
+    flower.resetStageCounters();
+
+    if (config.count("load")) {
+        loadgen::Arrival_t arrival;
+        if (!loadgen::parseArrival(config["load"], arrival)) {
+            fprintf(stderr, "%s", USAGE);
+            exit(-1);
+        }
+        std::vector<double> rates;
+        std::stringstream list(get(config, "rates", "100,200,400"));
+        std::string rate;
+        while (std::getline(list, rate, ',')) {
+            if (!rate.empty()) {
+                rates.push_back(atof(rate.c_str()));
+            }
+        }
+        std::vector<uint64_t> trace;
+        if (arrival == loadgen::ARRIVAL_TRACE) {
+            trace = loadgen::loadTrace(get(config, "trace", ""));
+            if (trace.empty()) {
+                LOG(ERROR) << "load=trace needs a non-empty trace=file";
+                exit(-1);
+            }
+        }
+
+        loadgen::LoadGenerator generator(&flower, encoded, decoded);
+        generator.burst_size = getInt(config, "burst", 16);
+        std::vector<loadgen::LoadPoint> curve = generator.sweep(arrival, rates, getDouble(config, "duration", 10), trace);
+
+        std::ostringstream report;
+        report << "{\n";
+        report << "  \"model\":\"" << flower.faceboxes_model_path << "\",\n";
+        report << "  \"load\":\"" << config["load"] << "\",\n";
+        report << "  \"curve\":" << loadgen::curveJson(curve) << "\n";
+        report << "}\n";
+        printf("%s", report.str().c_str());
+        if (config.count("report")) {
+            std::ofstream(config["report"]) << report.str();
+        }
+        flower.showVariantStats();
+        flower.showReorderStats();
+        flower.showStageCounters();
+        if (flower.sink) {
+            flower.sink->close();
+        }
+        LOG(INFO) << "Finish";
+        cnrtDestroy();
+        exit(0);
+    }
+
+    std::vector<RunResult> results;
+    for (int r = 0; r < repeats; ++r) {
+        results.push_back(run(flower, encoded, decoded, yuv, yuv_format, num_images, concurrency));
+        LOG(INFO) << "run " << r << " qps: " << results.back().qps;
+    }
+
+    double qps_mean = 0;
+    for (auto &result : results) {
+        qps_mean += result.qps;
+    }
+    qps_mean /= results.size();
+    double qps_var = 0;
+    for (auto &result : results) {
+        qps_var += (result.qps - qps_mean) * (result.qps - qps_mean);
+    }
+    double qps_stddev = results.size() > 1 ? sqrt(qps_var / (results.size() - 1)) : 0.;
+
+    std::vector<uint64_t> latencies;
+    for (auto &result : results) {
+        latencies.insert(latencies.end(), result.latencies.begin(), result.latencies.end());
+    }
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&](double p) -> uint64_t {
+        if (latencies.empty()) {
+            return 0;
+        }
+        return latencies[std::min(latencies.size() - 1, static_cast<size_t>(p * latencies.size()))];
+    };
+    double latency_mean = 0;
+    for (auto latency : latencies) {
+        latency_mean += latency;
+    }
+    latency_mean /= std::max<size_t>(1, latencies.size());
+
+    // Every run sees the same inputs in the same order, so the checksums must agree.
+    bool deterministic = true;
+    for (auto &result : results) {
+        deterministic = deterministic && result.checksum == results[0].checksum;
+    }
+    char checksum_hex[32];
+    snprintf(checksum_hex, sizeof(checksum_hex), "%016lx", results[0].checksum);
+
+    std::ostringstream report;
+    report << "{\n";
+    report << "  \"model\":\"" << flower.faceboxes_model_path << "\",\n";
+    report << "  \"num_images\":" << num_images << ",\n";
+    report << "  \"repeats\":" << repeats << ",\n";
+    report << "  \"concurrency\":" << concurrency << ",\n";
+    report << "  \"qps\":[";
+    for (size_t r = 0; r < results.size(); ++r) {
+        report << (r > 0 ? ", " : "") << results[r].qps;
+    }
+    report << "],\n";
+    report << "  \"qps_mean\":" << qps_mean << ",\n";
+    report << "  \"qps_stddev\":" << qps_stddev << ",\n";
+    report << "  \"latency_mean_us\":" << latency_mean << ",\n";
+    report << "  \"latency_p50_us\":" << percentile(0.5) << ",\n";
+    report << "  \"latency_p90_us\":" << percentile(0.9) << ",\n";
+    report << "  \"latency_p99_us\":" << percentile(0.99) << ",\n";
+    report << "  \"latency_max_us\":" << (latencies.empty() ? 0 : latencies.back()) << ",\n";
+    report << "  \"peak_rss_mb\":" << peakRssMb() << ",\n";
+    if (flower.tiling) {
+        report << "  \"tiles_per_image\":" << static_cast<double>(flower.tiles) / std::max<uint64_t>(1, flower.tiled_images) << ",\n";
+    }
+    // -1 when the barrier never opened or no result came out.
+    auto since_create_ms = [&](uint64_t time) {
+        return time == 0 ? -1 : static_cast<int64_t>(time - flower.create_time) / 1000;
+    };
+    report << "  \"models_ready_ms\":" << since_create_ms(flower.startup.isOpen() ? flower.startup.openTime() : 0) << ",\n";
+    report << "  \"first_result_ms\":" << since_create_ms(flower.first_result_time) << ",\n";
+    report << "  \"deterministic\":" << (deterministic ? "true" : "false") << ",\n";
+    report << "  \"checksum\":\"" << checksum_hex << "\"\n";
+    report << "}\n";
+    printf("%s", report.str().c_str());
+    flower.showVariantStats();
+    flower.showReorderStats();
+    flower.showStageCounters();
+    if (flower.tiling) {
+        flower.showTileStats();
+    }
+
+    if (config.count("report")) {
+        std::ofstream(config["report"]) << report.str();
+    }
+
+    int ret = 0;
+    if (!deterministic) {
+        LOG(ERROR) << "detections differ between runs";
+        ret = 2;
+    }
+    if (config.count("baseline")) {
+        std::vector<uchar> bytes = readFile(config["baseline"]);
+        std::string baseline(bytes.begin(), bytes.end());
+        double base_qps = atof(jsonValue(baseline, "qps_mean").c_str());
+        double base_p99 = atof(jsonValue(baseline, "latency_p99_us").c_str());
+        std::string base_checksum = jsonValue(baseline, "checksum");
+
+        LOG(INFO) << "baseline qps " << base_qps << " p99 " << base_p99 << " us";
+        if (base_qps > 0 && qps_mean < base_qps * (1 - tolerance)) {
+            LOG(ERROR) << "qps regression: " << qps_mean << " vs. " << base_qps;
+            ret = std::max(ret, 1);
+        }
+        if (base_p99 > 0 && percentile(0.99) > base_p99 * (1 + tolerance)) {
+            LOG(ERROR) << "p99 latency regression: " << percentile(0.99) << " vs. " << base_p99 << " us";
+            ret = std::max(ret, 1);
+        }
+        if (!base_checksum.empty() && base_checksum != checksum_hex) {
+            LOG(ERROR) << "detections changed: checksum " << checksum_hex << " vs. " << base_checksum;
+            ret = 2;
+        }
+    }
+
+    if (flower.sink) {
+        flower.sink->close();
+    }
+    LOG(INFO) << "Finish";
+    cnrtDestroy();
+    exit(ret);
 }
@@ -0,0 +1,36 @@
+#include "cnflow.h"
+#include "cnserver.h"
+
+#include <string>
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        LOG(ERROR) << "Usage: ./test_server model_path [port] [max_inflight_images]";
+        exit(-1);
+    }
+    std::string model_path = argv[1];
+    int port = argc > 2 ? atoi(argv[2]) : 9527;
+    // If > 0, requests beyond this many images in flight are rejected.
+    int max_inflight = argc > 3 ? atoi(argv[3]) : 0;
+
+    const int device = 0;
+    const int dp_faceboxes = 1;
+
+    cnflow::CnFlow flower;
+    flower.faceboxes_model_path = model_path;
+    flower.faceboxes_func_name = "fusion_0";
+    flower.device = device;
+    if (max_inflight > 0) {
+        flower.setInflightBudget(max_inflight, 256 << 20, cnflow::ADMIT_REJECT);
+    }
+
+    flower.addFaceBoxesPreprocessEx(8);
+    flower.addFaceBoxesInfer(dp_faceboxes);
+    flower.addFaceBoxesPostProcess(8);
+
+    cnserver::CnServer server(&flower, port);
+    server.start();
+    flower.join();
+
+    return 0;
+}
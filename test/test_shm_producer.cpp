@@ -0,0 +1,125 @@
+#include "shmring.h"
+#include "cnmodel.h"
+#include "tsque.h"
+#include "faceboxes_preprocess.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "glog/logging.h"
+
+/* A camera-like producer process next to test_shm_server: writes frames into the request ring
+ * with at most inflight unanswered, reads the detections back from the response ring.
+ */
+int main(int argc, char* argv[]) {
+    if (argc < 3) {
+        LOG(ERROR) << "Usage: ./test_shm_producer name image_path [frames] [inflight] [encoded|decoded|nv12|i420]";
+        exit(-1);
+    }
+    std::string name = argv[1];
+    std::string image_path = argv[2];
+    int frames = argc > 3 ? atoi(argv[3]) : 10000;
+    int inflight = argc > 4 ? atoi(argv[4]) : 32;
+    std::string input = argc > 5 ? argv[5] : "encoded";
+
+    std::ifstream file(image_path, std::ios::binary);
+    if (!file) {
+        LOG(ERROR) << "Can not open " << image_path;
+        exit(-1);
+    }
+    std::vector<uchar> encoded((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    cv::Mat image = cv::imdecode(encoded, cv::IMREAD_COLOR);
+    // Even size for 4:2:0.
+    image = image(cv::Rect(0, 0, image.cols & ~1, image.rows & ~1)).clone();
+    cv::Mat yuv;
+    if (input == "nv12" || input == "i420") {
+        yuv = bgr_to_yuv420(image, input == "nv12" ? YUV_NV12 : YUV_I420);
+    }
+
+    // The service creates the rings, wait for it.
+    shmring::ShmRing *requests = nullptr;
+    shmring::ShmRing *responses = nullptr;
+    while (!requests || !responses) {
+        delete requests;
+        delete responses;
+        requests = shmring::ShmRing::open("/" + name + "_req");
+        responses = shmring::ShmRing::open("/" + name + "_rsp");
+        if (!requests || !responses) {
+            sleep(1);
+        }
+    }
+
+    std::vector<uint64_t> send_times(frames);
+    std::vector<uint64_t> latencies;
+    std::atomic<int> answered{0};
+    int rejected = 0;
+
+    uint64_t t1 = cnmodel::time();
+    std::thread reader([&]() {
+        cnflow::Detections boxes;
+        uint64_t tag;
+        bool is_rejected;
+        for (int i = 0; i < frames; ++i) {
+            shmring::getResponse(responses, tag, boxes, is_rejected, true);
+            if (is_rejected) {
+                ++rejected;
+            }
+            else if (tag < send_times.size()) {
+                latencies.push_back(cnmodel::time() - send_times[tag]);
+            }
+            ++answered;
+        }
+    });
+
+    for (int i = 0; i < frames; ++i) {
+        while (i - answered >= inflight) {
+            USLEEP(20);
+        }
+        send_times[i] = cnmodel::time();
+        bool ok;
+        if (input == "decoded") {
+            ok = shmring::putFrame(requests, i, image);
+        }
+        else if (!yuv.empty()) {
+            ok = shmring::putYuv(requests, i, yuv, input == "nv12" ? shmring::SLOT_NV12 : shmring::SLOT_I420);
+        }
+        else {
+            ok = shmring::putEncoded(requests, i, encoded);
+        }
+        if (!ok) {
+            LOG(ERROR) << "Frame " << i << " does not fit the ring";
+            exit(-1);
+        }
+    }
+    reader.join();
+    uint64_t t2 = cnmodel::time();
+
+    if (latencies.empty()) {
+        return -1;
+    }
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&](double p) {
+        return latencies[std::min(latencies.size() - 1, static_cast<size_t>(p * latencies.size()))];
+    };
+    double mean = 0;
+    for (auto latency : latencies) {
+        mean += latency;
+    }
+    mean /= latencies.size();
+
+    printf("frames: %zu rejected: %d\n", latencies.size(), rejected);
+    printf("qps: %lf\n", 1000000. * latencies.size() / (t2 - t1));
+    printf("latency mean: %.1lf us p50: %lu us p90: %lu us p99: %lu us max: %lu us\n",
+           mean, percentile(0.5), percentile(0.9), percentile(0.99), latencies.back());
+
+    delete requests;
+    delete responses;
+    return 0;
+}
@@ -0,0 +1,36 @@
+#include "cnflow.h"
+
+#include <unistd.h>
+
+#include <string>
+
+/* Inference service for co-located producers: one shared-memory source per name. */
+int main(int argc, char* argv[]) {
+    if (argc < 3) {
+        LOG(ERROR) << "Usage: ./test_shm_server model_path name [name ...]";
+        exit(-1);
+    }
+    std::string model_path = argv[1];
+
+    const int device = 0;
+    const int dp_faceboxes = 1;
+
+    cnflow::CnFlow flower;
+    flower.faceboxes_model_path = model_path;
+    flower.faceboxes_func_name = "fusion_0";
+    flower.device = device;
+
+    flower.addFaceBoxesPreprocessEx(8);
+    flower.addFaceBoxesInfer(dp_faceboxes);
+    flower.addFaceBoxesPostProcess(8);
+
+    for (int i = 2; i < argc; ++i) {
+        flower.addShmSource(argv[i]);
+    }
+    while (true) {
+        sleep(10);
+        flower.showShmStats();
+    }
+
+    return 0;
+}
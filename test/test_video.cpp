@@ -0,0 +1,50 @@
+#include "cnflow.h"
+
+#include <string>
+#include <vector>
+
+int main(int argc, char* argv[]) {
+    if (argc < 4) {
+        LOG(ERROR) << "Usage: ./test_video model_path frame_stride video [video ...]";
+        exit(-1);
+    }
+    std::string model_path = argv[1];
+    int frame_stride = atoi(argv[2]);
+
+    const int device = 0;
+    const int dp_faceboxes = 1;
+
+    cnflow::CnFlow flower;
+    flower.faceboxes_model_path = model_path;
+    flower.faceboxes_func_name = "fusion_0";
+    flower.device = device;
+    // Keep at most 256 frames in flight, the decoders drop frames beyond that.
+    flower.setInflightBudget(256, 256 << 20, cnflow::ADMIT_REJECT);
+
+    flower.addFaceBoxesPreprocessEx(8);
+    flower.addFaceBoxesInfer(dp_faceboxes);
+    flower.addFaceBoxesPostProcess(8);
+    flower.startMetrics(0, 100);
+
+    std::vector<std::shared_ptr<cnflow::VideoStream>> streams;
+    for (int i = 3; i < argc; ++i) {
+        streams.push_back(flower.addVideoSource(argv[i], frame_stride, true));
+    }
+
+    while (true) {
+        USLEEP(1000000);
+        bool finished = flower.admission.images() == 0;
+        for (auto &stream : streams) {
+            finished = finished && stream->finished;
+        }
+        flower.showVideoStats();
+        flower.showQueueSize();
+        if (finished) {
+            break;
+        }
+    }
+
+    LOG(INFO) << "Finish";
+    cnrtDestroy();
+    exit(0);
+}
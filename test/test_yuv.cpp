@@ -0,0 +1,89 @@
+#include "faceboxes_preprocess.h"
+#include "cnmodel.h"
+
+#include <cmath>
+#include <string>
+
+#include "glog/logging.h"
+
+/* Preprocess of a YUV 4:2:0 frame to the model input: the fused faceboxes_preprocess_yuv
+ * against cv::cvtColor to a full BGR frame then faceboxes_preprocess. Prints time per frame,
+ * the bytes each path moves through memory, and how far the outputs are apart. The two paths
+ * interpolate chroma and round differently, so they only agree within a tolerance: exit 1 when
+ * the max or the mean difference of any format exceeds it.
+ */
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        LOG(ERROR) << "Usage: ./test_yuv image_path [frame_width] [frame_height] [model_size] [iterations]"
+                   << " [max_diff=48] [mean_diff=2]";
+        exit(-1);
+    }
+    int frame_width = argc > 2 ? atoi(argv[2]) : 1920;
+    int frame_height = argc > 3 ? atoi(argv[3]) : 1080;
+    int model_size = argc > 4 ? atoi(argv[4]) : 500;
+    int iterations = argc > 5 ? atoi(argv[5]) : 200;
+    double max_tolerance = argc > 6 ? atof(argv[6]) : 48.;
+    double mean_tolerance = argc > 7 ? atof(argv[7]) : 2.;
+    int ret = 0;
+
+    cv::Mat image = cv::imread(argv[1]);
+    if (image.empty()) {
+        LOG(ERROR) << "Can not read " << argv[1];
+        exit(-1);
+    }
+    cv::resize(image, image, cv::Size(frame_width & ~1, frame_height & ~1));
+
+    for (YuvFormat_t format : {YUV_NV12, YUV_I420}) {
+        const char *name = format == YUV_NV12 ? "nv12" : "i420";
+        cv::Mat yuv = bgr_to_yuv420(image, format);
+        float ratio;
+
+        uint64_t t1 = cnmodel::time();
+        cv::Mat twostep;
+        for (int i = 0; i < iterations; ++i) {
+            cv::Mat bgr;
+            cv::cvtColor(yuv, bgr, format == YUV_NV12 ? cv::COLOR_YUV2BGR_NV12 : cv::COLOR_YUV2BGR_I420);
+            twostep = faceboxes_preprocess(bgr, model_size, model_size, ratio);
+        }
+        uint64_t t2 = cnmodel::time();
+        cv::Mat fused;
+        for (int i = 0; i < iterations; ++i) {
+            fused = faceboxes_preprocess_yuv(yuv, format, model_size, model_size, ratio);
+        }
+        uint64_t t3 = cnmodel::time();
+
+        // Two-step: read YUV, write and read back the BGR frame, write the resized and the padded image.
+        double pixels = static_cast<double>(yuv.cols) * (yuv.rows * 2 / 3);
+        double out_bytes = 3. * model_size * model_size;
+        double twostep_bytes = 1.5 * pixels + 3 * pixels + 3 * pixels + 2 * out_bytes;
+        // Fused: two source rows of Y and chroma per output row, one write of the output.
+        int rszheight = std::min(model_size, static_cast<int>(round(yuv.rows * 2 / 3 * ratio)));
+        double fused_bytes = std::min(1.5 * pixels, 2. * rszheight * yuv.cols * 2) + out_bytes;
+
+        double max_diff = 0;
+        double sum_diff = 0;
+        for (int y = 0; y < model_size; ++y) {
+            const uint8_t *a = twostep.ptr<uint8_t>(y);
+            const uint8_t *b = fused.ptr<uint8_t>(y);
+            for (int x = 0; x < model_size * 3; ++x) {
+                double diff = std::abs(a[x] - b[x]);
+                max_diff = std::max(max_diff, diff);
+                sum_diff += diff;
+            }
+        }
+
+        double twostep_us = static_cast<double>(t2 - t1) / iterations;
+        double fused_us = static_cast<double>(t3 - t2) / iterations;
+        printf("%s %dx%d -> %d: cvtColor+resize %.1lf us (%.0lf fps, %.1lf MB) fused %.1lf us (%.0lf fps, %.1lf MB) speedup %.2lfx\n",
+               name, yuv.cols, yuv.rows * 2 / 3, model_size,
+               twostep_us, 1000000. / twostep_us, twostep_bytes / 1e6,
+               fused_us, 1000000. / fused_us, fused_bytes / 1e6, twostep_us / fused_us);
+        double mean_diff = sum_diff / (3. * model_size * model_size);
+        printf("%s output diff: max %.0lf mean %.3lf\n", name, max_diff, mean_diff);
+        if (max_diff > max_tolerance || mean_diff > mean_tolerance) {
+            LOG(ERROR) << name << ": fused output differs beyond max " << max_tolerance << " mean " << mean_tolerance;
+            ret = 1;
+        }
+    }
+    return ret;
+}